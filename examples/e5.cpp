@@ -1,4 +1,5 @@
 #include "../src/mesh.hpp"
+#include <algorithm>
 #include <iostream>
 #include <glm/gtc/matrix_transform.hpp>
 
@@ -9,8 +10,12 @@ int main(){
   Mesh mesh("meshes/bunny-1k.obj");
   mesh.loop_subdivision();
   mesh.view();
-  mesh.loop_subdivision();
+  // one level with its vertices moved onto the limit surface, instead of
+  // subdividing again
+  std::vector<glm::vec3> positions, normals;
+  mesh.limit_vertices(positions, normals);
+  std::copy(positions.begin(), positions.end(), mesh.vertex_positions().begin());
+  std::copy(normals.begin(), normals.end(), mesh.vertex_normals().begin());
   mesh.view();
   return 0;
 }
-
@@ -0,0 +1,18 @@
+#include "../src/mesh.hpp"
+#include <iostream>
+
+/**
+ * Decimation example
+ */
+int main(){
+  Mesh mesh("meshes/teapot.obj");
+  //Mesh mesh("meshes/bunny-1k.obj");
+  // subdivide to about 400k faces, then collapse back to 20k
+  for (int i = 0; i < 3; i++) {
+    mesh.loop_subdivision();
+  }
+  mesh.decimate(20000);
+  std::cout << mesh.num_faces() << " faces" << std::endl;
+  mesh.view();
+  return 0;
+}
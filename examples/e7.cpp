@@ -0,0 +1,25 @@
+#include "../src/mesh.hpp"
+#include <iostream>
+
+/**
+ * Remeshing example
+ */
+int main(){
+  Mesh mesh("meshes/bunny-1k.obj");
+  // edges of about half the current mean length
+  double total = 0.0;
+  size_t count = 0;
+  Span<glm::vec3> positions = mesh.vertex_positions();
+  for (size_t f = 1; f <= mesh.num_faces(); f++) {
+    uint32_t he = mesh.face_halfEdge(f);
+    for (int k = 0; k < 3; k++) {
+      glm::vec3 d = positions[mesh.edge_head(mesh.edge_next(he + k))] - positions[mesh.edge_head(he + k)];
+      total += glm::length(d);
+      count++;
+    }
+  }
+  mesh.remesh(0.5f * total / count, 10);
+  std::cout << mesh.num_faces() << " faces" << std::endl;
+  mesh.view();
+  return 0;
+}
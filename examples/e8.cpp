@@ -0,0 +1,39 @@
+#include "../src/mesh.hpp"
+#include <iostream>
+#include <vector>
+
+/**
+ * Batched edge operations example
+ */
+int main(){
+  Mesh mesh("meshes/bunny-1k.obj");
+  // split every edge longer than the mean in one batch
+  Span<glm::vec3> positions = mesh.vertex_positions();
+  std::vector<float> lengths;
+  std::vector<EdgeRequest<uint32_t>> requests;
+  double total = 0.0;
+  for (uint32_t he = 1; he <= 3 * mesh.num_faces(); he++) {
+    uint32_t pair = mesh.edge_pair(he);
+    if (pair != 0 && pair < he) {
+      continue;
+    }
+    float length = glm::length(positions[mesh.edge_head(mesh.edge_next(he))] - positions[mesh.edge_head(he)]);
+    lengths.push_back(length);
+    total += length;
+  }
+  float mean = total / lengths.size();
+  size_t i = 0;
+  for (uint32_t he = 1; he <= 3 * mesh.num_faces(); he++) {
+    uint32_t pair = mesh.edge_pair(he);
+    if (pair != 0 && pair < he) {
+      continue;
+    }
+    if (lengths[i++] > mean) {
+      requests.push_back(EdgeRequest<uint32_t>{he, SplitEdge});
+    }
+  }
+  mesh.apply_edge_operations(requests);
+  std::cout << requests.size() << " splits, " << mesh.num_faces() << " faces" << std::endl;
+  mesh.view();
+  return 0;
+}
@@ -0,0 +1,156 @@
+#pragma once
+#include <cstddef>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+
+// Allocator returning 64-byte aligned blocks, so buffers can be streamed
+// with aligned SIMD loads
+template <class T>
+struct AlignedAllocator
+{
+    typedef T value_type;
+    static const size_t alignment = 64;
+
+    AlignedAllocator(){}
+    template <class U>
+    AlignedAllocator(const AlignedAllocator<U>&){}
+
+    T* allocate(size_t n){
+      void* p = nullptr;
+      if (posix_memalign(&p, alignment, n * sizeof(T) + alignment) != 0) {
+        throw std::bad_alloc();
+      }
+      return static_cast<T*>(p);
+    }
+    void deallocate(T* p, size_t){
+      free(p);
+    }
+    template <class U>
+    bool operator==(const AlignedAllocator<U>&) const { return true; }
+    template <class U>
+    bool operator!=(const AlignedAllocator<U>&) const { return false; }
+};
+
+// Non-owning view of a contiguous array
+template <class T>
+struct Span
+{
+    T* ptr = nullptr;
+    size_t count = 0;
+
+    Span(){}
+    Span(T* ptr, size_t count) : ptr(ptr), count(count){}
+
+    size_t size() const { return this->count; }
+    T* data() const { return this->ptr; }
+    T& operator[](size_t i) const { return this->ptr[i]; }
+    T* begin() const { return this->ptr; }
+    T* end() const { return this->ptr + this->count; }
+};
+
+// Contiguous array used for the mesh storage. It either owns its elements,
+// 64-byte aligned and padded by a cache line past the end, or borrows memory
+// that lives elsewhere (e.g. a mapped file), kept alive by a shared handle. A
+// borrowed buffer is copied into owned storage the first time its size
+// changes, or when the buffer itself is copied.
+template <class T>
+class Buffer
+{
+  public:
+    Buffer(){}
+    explicit Buffer(size_t n) : owned(n){
+      sync();
+    }
+    Buffer(const Buffer& other){
+      *this = other;
+    }
+    Buffer(Buffer&& other){
+      *this = std::move(other);
+    }
+    Buffer& operator=(const Buffer& other){
+      // copies always own their elements, so they never alias a borrowed buffer
+      if (this != &other) {
+        this->keepAlive.reset();
+        this->owned.assign(other.begin(), other.end());
+        sync();
+      }
+      return *this;
+    }
+    Buffer& operator=(Buffer&& other){
+      if (this != &other) {
+        this->keepAlive = std::move(other.keepAlive);
+        this->owned = std::move(other.owned);
+        this->ptr = other.ptr;
+        this->count = other.count;
+        other.owned.clear();
+        other.keepAlive.reset();
+        other.sync();
+      }
+      return *this;
+    }
+
+    // Points the buffer at n elements owned by someone else
+    void borrow(T* data, size_t n, std::shared_ptr<void> keepAlive){
+      this->owned.clear();
+      this->owned.shrink_to_fit();
+      this->keepAlive = keepAlive;
+      this->ptr = data;
+      this->count = n;
+    }
+    bool borrowed() const {
+      return (bool)this->keepAlive;
+    }
+
+    size_t size() const { return this->count; }
+    bool empty() const { return this->count == 0; }
+    T* data() { return this->ptr; }
+    const T* data() const { return this->ptr; }
+    T& operator[](size_t i) { return this->ptr[i]; }
+    const T& operator[](size_t i) const { return this->ptr[i]; }
+    T* begin() { return this->ptr; }
+    T* end() { return this->ptr + this->count; }
+    const T* begin() const { return this->ptr; }
+    const T* end() const { return this->ptr + this->count; }
+    T& back() { return this->ptr[this->count - 1]; }
+    Span<T> span() { return Span<T>(this->ptr, this->count); }
+
+    void push_back(const T& value){
+      own();
+      this->owned.push_back(value);
+      sync();
+    }
+    void resize(size_t n){
+      own();
+      this->owned.resize(n);
+      sync();
+    }
+    void reserve(size_t n){
+      own();
+      this->owned.reserve(n);
+      sync();
+    }
+    void clear(){
+      this->keepAlive.reset();
+      this->owned.clear();
+      sync();
+    }
+
+  private:
+    std::vector<T, AlignedAllocator<T>> owned;
+    std::shared_ptr<void> keepAlive;
+    T* ptr = nullptr;
+    size_t count = 0;
+
+    void own(){
+      if (this->keepAlive) {
+        this->owned.assign(this->ptr, this->ptr + this->count);
+        this->keepAlive.reset();
+      }
+    }
+    void sync(){
+      this->ptr = this->owned.data();
+      this->count = this->owned.size();
+    }
+};
@@ -0,0 +1,519 @@
+#include "mesh.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <glm/geometric.hpp>
+#include <limits>
+#include <vector>
+
+// Quadric error metric decimation (Garland and Heckbert, "Surface
+// simplification using quadric error metrics"). Every vertex carries the
+// quadric of the planes of its original faces, which measures the sum of
+// squared distances to them. Collapsing an edge merges the quadrics of its
+// ends and moves the kept vertex to the point where the sum is smallest;
+// that sum is the cost of the edge, and the cheapest edge goes first.
+
+namespace {
+
+// Weight of the planes through boundary edges, perpendicular to their
+// faces, that hold the boundary in place
+const double boundaryWeight = 10.0;
+
+// Collapses that turn a face by more than about 78 degrees are skipped
+const double minFaceCos = 0.2;
+
+// The bulk passes stop at this many times the target face count
+const size_t bulkFactor = 2;
+
+// Symmetric 4x4 matrix, upper triangle row by row
+struct Quadric
+{
+    double a[10] = {};
+
+    // Adds w times the squared distance to the plane dot(n, x) + d = 0, n unit length
+    void add_plane(const glm::dvec3& n, double d, double w){
+      double p[4] = {n.x, n.y, n.z, d};
+      int k = 0;
+      for (int i = 0; i < 4; i++) {
+        for (int j = i; j < 4; j++) {
+          this->a[k++] += w * p[i] * p[j];
+        }
+      }
+    }
+    Quadric& operator+=(const Quadric& q){
+      for (int k = 0; k < 10; k++) {
+        this->a[k] += q.a[k];
+      }
+      return *this;
+    }
+    double error(const glm::dvec3& p) const {
+      const double* a = this->a;
+      double e = a[0] * p.x * p.x + 2 * a[1] * p.x * p.y + 2 * a[2] * p.x * p.z + 2 * a[3] * p.x
+        + a[4] * p.y * p.y + 2 * a[5] * p.y * p.z + 2 * a[6] * p.y
+        + a[7] * p.z * p.z + 2 * a[8] * p.z + a[9];
+      return std::max(e, 0.0);
+    }
+    // Point of least error, false if the 3x3 part is close to singular, as
+    // on flat regions and creases
+    bool minimum(glm::dvec3& p) const {
+      const double* a = this->a;
+      double c0 = a[4] * a[7] - a[5] * a[5];
+      double c1 = a[2] * a[5] - a[1] * a[7];
+      double c2 = a[1] * a[5] - a[2] * a[4];
+      double det = a[0] * c0 + a[1] * c1 + a[2] * c2;
+      double scale = a[0] + a[4] + a[7];
+      if (std::abs(det) <= 1e-9 * scale * scale * scale) {
+        return false;
+      }
+      // inverse by cofactors times -b
+      double c3 = a[0] * a[7] - a[2] * a[2];
+      double c4 = a[1] * a[2] - a[0] * a[5];
+      double c5 = a[0] * a[4] - a[1] * a[1];
+      p.x = -(c0 * a[3] + c1 * a[6] + c2 * a[8]) / det;
+      p.y = -(c1 * a[3] + c3 * a[6] + c4 * a[8]) / det;
+      p.z = -(c2 * a[3] + c4 * a[6] + c5 * a[8]) / det;
+      return true;
+    }
+};
+
+// Where the ends p0 and p1 of an edge with quadric q meet: the minimum of
+// q, or the best point on the edge when that is not well defined
+glm::dvec3 collapse_point(const Quadric& q, const glm::dvec3& p0, const glm::dvec3& p1){
+  glm::dvec3 p;
+  if (q.minimum(p)) {
+    return p;
+  }
+  // q restricted to the edge is the quadratic dAd t^2 + 2 g t + const
+  const double* a = q.a;
+  glm::dvec3 d = p1 - p0;
+  glm::dvec3 ad(a[0] * d.x + a[1] * d.y + a[2] * d.z, a[1] * d.x + a[4] * d.y + a[5] * d.z, a[2] * d.x + a[5] * d.y + a[7] * d.z);
+  glm::dvec3 b(a[3], a[6], a[8]);
+  glm::dvec3 ap0(a[0] * p0.x + a[1] * p0.y + a[2] * p0.z, a[1] * p0.x + a[4] * p0.y + a[5] * p0.z, a[2] * p0.x + a[5] * p0.y + a[7] * p0.z);
+  double dad = glm::dot(d, ad);
+  double t = 0.5;
+  if (dad > 1e-12 * glm::dot(d, d) * (a[0] + a[4] + a[7])) {
+    t = std::min(1.0, std::max(0.0, -glm::dot(d, ap0 + b) / dad));
+  }
+  return p0 + t * d;
+}
+
+// Min-heap of edges by cost, ties broken by half-edge, with the heap
+// position of every half-edge so entries can be changed in place
+template <class Index>
+class EdgeHeap
+{
+  public:
+    struct Entry
+    {
+        float cost;
+        Index he;
+    };
+    static const Index none = std::numeric_limits<Index>::max();
+
+    explicit EdgeHeap(size_t numHalfEdges) : position(numHalfEdges, none){}
+
+    // Heapifies all entries at once
+    void build(std::vector<Entry>& entries){
+      this->heap.swap(entries);
+      for (size_t i = 0; i < this->heap.size(); i++) {
+        this->position[this->heap[i].he] = i;
+      }
+      for (size_t i = this->heap.size() / 2; i-- > 0;) {
+        sift_down(i);
+      }
+    }
+    bool empty() const { return this->heap.empty(); }
+    const Entry& top() const { return this->heap[0]; }
+    bool contains(Index he) const { return this->position[he] != none; }
+    float cost(Index he) const { return this->heap[this->position[he]].cost; }
+
+    void push(Index he, float cost){
+      this->position[he] = this->heap.size();
+      this->heap.push_back(Entry{cost, he});
+      sift_up(this->heap.size() - 1);
+    }
+    void update(Index he, float cost){
+      size_t i = this->position[he];
+      this->heap[i].cost = cost;
+      sift_up(i);
+      sift_down(this->position[he]);
+    }
+    void remove(Index he){
+      size_t i = this->position[he];
+      this->position[he] = none;
+      Entry last = this->heap.back();
+      this->heap.pop_back();
+      if (i < this->heap.size()) {
+        this->heap[i] = last;
+        this->position[last.he] = i;
+        sift_up(i);
+        sift_down(this->position[last.he]);
+      }
+    }
+
+  private:
+    std::vector<Entry> heap;
+    std::vector<Index> position;
+
+    static bool less(const Entry& a, const Entry& b){
+      return a.cost < b.cost || (a.cost == b.cost && a.he < b.he);
+    }
+    void place(size_t i, const Entry& e){
+      this->heap[i] = e;
+      this->position[e.he] = i;
+    }
+    void sift_up(size_t i){
+      Entry e = this->heap[i];
+      while (i > 0 && less(e, this->heap[(i - 1) / 2])) {
+        place(i, this->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+      }
+      place(i, e);
+    }
+    void sift_down(size_t i){
+      Entry e = this->heap[i];
+      size_t n = this->heap.size();
+      while (2 * i + 1 < n) {
+        size_t child = 2 * i + 1;
+        if (child + 1 < n && less(this->heap[child + 1], this->heap[child])) {
+          child++;
+        }
+        if (!less(this->heap[child], e)) {
+          break;
+        }
+        place(i, this->heap[child]);
+        i = child;
+      }
+      place(i, e);
+    }
+};
+
+template <class Index>
+const Index EdgeHeap<Index>::none;
+
+template <class Index>
+glm::dvec3 position(BasicMesh<Index>& mesh, Index v){
+  return glm::dvec3(mesh.vertex_positions()[v]);
+}
+
+// Unit normal and offset of the plane of face f, false if it has no area
+template <class Index>
+bool face_plane(BasicMesh<Index>& mesh, Index f, glm::dvec3& n, double& d){
+  std::array<Index, 3> c = mesh.face_vertices(f);
+  glm::dvec3 p0 = position(mesh, c[0]);
+  n = glm::cross(position(mesh, c[1]) - p0, position(mesh, c[2]) - p0);
+  double length = glm::length(n);
+  if (length == 0.0) {
+    return false;
+  }
+  n /= length;
+  d = -glm::dot(n, p0);
+  return true;
+}
+
+// Adds the plane through boundary half-edge he perpendicular to its face
+template <class Index>
+void add_boundary_plane(BasicMesh<Index>& mesh, Index he, Quadric& q){
+  glm::dvec3 n;
+  double d;
+  if (!face_plane(mesh, mesh.edge_left(he), n, d)) {
+    return;
+  }
+  glm::dvec3 p0 = position(mesh, mesh.edge_head(he));
+  glm::dvec3 side = glm::cross(position(mesh, mesh.edge_head(mesh.edge_next(he))) - p0, n);
+  double length = glm::length(side);
+  if (length > 0.0) {
+    side /= length;
+    q.add_plane(side, -glm::dot(side, p0), boundaryWeight);
+  }
+}
+
+// Whether moving the ends of he to p turns one of the faces around them,
+// other than the faces of he, too far
+template <class Index>
+bool folds(BasicMesh<Index>& mesh, Index he, const glm::dvec3& p){
+  Index v0 = mesh.edge_head(he);
+  Index v1 = mesh.edge_head(mesh.edge_next(he));
+  Index f0 = mesh.edge_left(he);
+  Index f1 = mesh.edge_pair(he) ? mesh.edge_left(mesh.edge_pair(he)) : 0;
+  for (Index v : {v0, v1}) {
+    for (Index f : mesh.vertex_faces(v)) {
+      if (f == f0 || f == f1) {
+        continue;
+      }
+      std::array<Index, 3> c = mesh.face_vertices(f);
+      glm::dvec3 before[3];
+      glm::dvec3 after[3];
+      for (int k = 0; k < 3; k++) {
+        before[k] = position(mesh, c[k]);
+        after[k] = c[k] == v0 || c[k] == v1 ? p : before[k];
+      }
+      glm::dvec3 n0 = glm::cross(before[1] - before[0], before[2] - before[0]);
+      glm::dvec3 n1 = glm::cross(after[1] - after[0], after[2] - after[0]);
+      if (glm::dot(n0, n1) <= minFaceCos * glm::length(n0) * glm::length(n1)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// The half-edge that stands for the edge of he in the heap: the higher of
+// the pair, or he itself on a boundary
+template <class Index>
+Index edge_owner(BasicMesh<Index>& mesh, Index he){
+  return std::max(he, mesh.edge_pair(he));
+}
+
+// Calls f(he) for a half-edge of every edge at v: the outgoing ones, and the
+// incoming boundary half-edge of a boundary vertex
+template <class Index, class F>
+void for_vertex_edges(BasicMesh<Index>& mesh, Index v, F f){
+  Index start = mesh.vertex_halfEdge(v);
+  if (start == 0) {
+    return;
+  }
+  for (Index he : mesh.vertex_outgoing(v)) {
+    f(he);
+  }
+  Index incoming = mesh.edge_prev(start);
+  if (mesh.edge_pair(incoming) == 0) {
+    f(incoming);
+  }
+}
+
+}
+
+// Decimation runs in two phases. Bulk passes take the mesh down to a few
+// times the target: each pass sorts the edges by cost and picks, cheapest
+// first, edges whose ends lie outside the one-rings of the edges already
+// picked. Such collapses do not touch each other's faces, so their fold
+// checks run in parallel and they are applied in memory order. The rest is
+// collapsed one edge at a time from an indexed heap. Whether a collapse is
+// allowed (link condition, folds) is only checked lazily when its edge
+// reaches the top; a refused edge is parked at infinite cost until a
+// collapse moves one of its ends, or until nothing but parked edges is left.
+// Collapses only mark faces and vertices deleted, so half-edge indices stay
+// valid within each phase; the mesh is compacted between them.
+template <class Index>
+void BasicMesh<Index>::decimate(size_t targetFaces, float maxError){
+  size_t numHalfEdges = this->halfEdges.size();
+  if (numHalfEdges == 0) {
+    return;
+  }
+  size_t liveFaces = num_faces() - this->freeFaces.size();
+
+  // vertex quadrics, every vertex summing its own faces
+  std::vector<Quadric> quadrics(this->positions.size());
+  parallel_for(this->positions.size() - 1, [&](size_t i){
+    Index v = i + 1;
+    if (vertex_deleted(v)) {
+      return;
+    }
+    Quadric& q = quadrics[v];
+    glm::dvec3 n;
+    double d;
+    for (Index f : vertex_faces(v)) {
+      if (face_plane(*this, f, n, d)) {
+        q.add_plane(n, d, 1.0);
+      }
+    }
+    for_vertex_edges(*this, v, [&](Index he){
+      if (edge_pair(he) == 0) {
+        add_boundary_plane(*this, he, q);
+      }
+    });
+  });
+
+  auto cost = [&](Index he, glm::dvec3& p) -> float {
+    Index v0 = edge_head(he);
+    Index v1 = edge_head(edge_next(he));
+    Quadric q = quadrics[v0];
+    q += quadrics[v1];
+    p = collapse_point(q, position(*this, v0), position(*this, v1));
+    return (float)q.error(p);
+  };
+  auto owns = [&](size_t h){
+    return edge_head(h) != 0 && edge_owner(*this, (Index)h) == h;
+  };
+  // cost of every edge, stored at its owner
+  std::vector<float> costs;
+  auto cost_edges = [&](){
+    costs.assign(numHalfEdges, 0.0f);
+    parallel_for(numHalfEdges, [&](size_t h){
+      glm::dvec3 p;
+      if (h != 0 && owns(h)) {
+        costs[h] = cost(h, p);
+      }
+    });
+  };
+  cost_edges();
+  // Collapses he into p and brings the costs of the edges at the kept
+  // vertex up to date; returns that vertex, 0 if the edge is not collapsible
+  auto apply = [&](Index he, const glm::dvec3& p) -> Index {
+    Index v0 = edge_head(he);
+    Index e3 = edge_pair(he);
+    Index v1 = edge_collapse(he);
+    if (v1 == 0) {
+      return 0;
+    }
+    this->positions[v1] = glm::vec3(p);
+    quadrics[v1] += quadrics[v0];
+    liveFaces -= e3 ? 2 : 1;
+    glm::dvec3 q;
+    for_vertex_edges(*this, v1, [&](Index x){
+      Index owner = edge_owner(*this, x);
+      costs[owner] = cost(owner, q);
+    });
+    return v1;
+  };
+
+  typedef typename EdgeHeap<Index>::Entry Entry;
+  const float infinity = std::numeric_limits<float>::infinity();
+  const float limit = maxError * maxError;
+  std::vector<Entry> entries;
+  std::vector<Entry> scratch;
+  std::vector<uint8_t> locked;
+  std::vector<Index> picked;
+  // passes stop short of the goal rather than sweeping the mesh for a few
+  // collapses, and when one no longer removes a percent of the faces
+  while (liveFaces > bulkFactor * targetFaces + liveFaces / 100) {
+    size_t before = liveFaces;
+    entries.clear();
+    for (size_t h = 1; h < numHalfEdges; h++) {
+      if (owns(h) && costs[h] <= limit) {
+        entries.push_back(Entry{costs[h], (Index)h});
+      }
+    }
+    // costs are not negative, so their bits sort like the floats
+    radix_sort(entries, scratch, 32, [](const Entry& e){
+      uint32_t bits;
+      std::memcpy(&bits, &e.cost, sizeof(bits));
+      return bits;
+    });
+    // the cheaper half of the edges is considered, and no more collapses
+    // than the bulk passes still need
+    size_t wanted = (liveFaces - bulkFactor * targetFaces + 1) / 2;
+    locked.assign(this->positions.size(), 0);
+    picked.clear();
+    for (size_t i = 0; i < (entries.size() + 1) / 2 && picked.size() < wanted; i++) {
+      Index he = entries[i].he;
+      Index v0 = edge_head(he);
+      Index v1 = edge_head(edge_next(he));
+      if (locked[v0] || locked[v1]) {
+        continue;
+      }
+      picked.push_back(he);
+      for (Index v : {v0, v1}) {
+        locked[v] = 1;
+        for (Index u : vertex_neighbours(v)) {
+          locked[u] = 1;
+        }
+      }
+    }
+    std::sort(picked.begin(), picked.end());
+    std::vector<glm::dvec3> points(picked.size());
+    std::vector<uint8_t> folded(picked.size());
+    parallel_for(picked.size(), [&](size_t i){
+      cost(picked[i], points[i]);
+      folded[i] = folds(*this, picked[i], points[i]);
+    });
+    for (size_t i = 0; i < picked.size(); i++) {
+      if (!folded[i]) {
+        apply(picked[i], points[i]);
+      }
+    }
+    if (before - liveFaces <= before / 100) {
+      break;
+    }
+  }
+
+  if (liveFaces < num_faces()) {
+    // the heap works on a much smaller mesh than the passes started with,
+    // compacting it keeps the heap's index arrays small
+    std::vector<Index> vertexMap;
+    compact(KeepOrder, &vertexMap);
+    std::vector<Quadric> moved(this->positions.size());
+    parallel_for(vertexMap.size(), [&](size_t v){
+      if (vertexMap[v] != 0) {
+        moved[vertexMap[v]] = quadrics[v];
+      }
+    });
+    quadrics.swap(moved);
+    numHalfEdges = this->halfEdges.size();
+    cost_edges();
+  }
+  entries.clear();
+  for (size_t h = 1; h < numHalfEdges; h++) {
+    if (owns(h)) {
+      entries.push_back(Entry{costs[h], (Index)h});
+    }
+  }
+  EdgeHeap<Index> heap(numHalfEdges);
+  heap.build(entries);
+  std::vector<Index> parked;
+  size_t collapsed = 0;
+  while (liveFaces > targetFaces && !heap.empty()) {
+    Entry top = heap.top();
+    if (top.cost == infinity && collapsed > 0) {
+      // only refused edges are left, they get one more chance each time
+      // something was collapsed since they were parked
+      for (Index x : parked) {
+        if (heap.contains(x) && heap.cost(x) == infinity) {
+          heap.update(x, costs[x]);
+        }
+      }
+      parked.clear();
+      collapsed = 0;
+      continue;
+    }
+    if (top.cost == infinity || top.cost > limit) {
+      break;
+    }
+    Index he = top.he;
+    glm::dvec3 p;
+    cost(he, p);
+    Index e3 = edge_pair(he);
+    Index f0 = edge_left(he);
+    Index f1 = e3 ? edge_left(e3) : 0;
+    Index v1 = folds(*this, he, p) ? 0 : apply(he, p);
+    if (v1 == 0) {
+      heap.update(he, infinity);
+      parked.push_back(he);
+      continue;
+    }
+    for (Index f : {f0, f1}) {
+      for (Index k = 0; f != 0 && k < 3; k++) {
+        if (heap.contains(3 * f - 2 + k)) {
+          heap.remove(3 * f - 2 + k);
+        }
+      }
+    }
+    // the sides of a removed face merged into one edge, which keeps the
+    // entry of its owner; every edge at v1 has a new cost
+    for_vertex_edges(*this, v1, [&](Index x){
+      Index owner = edge_owner(*this, x);
+      Index other = edge_pair(x) ? std::min(x, edge_pair(x)) : 0;
+      if (other != 0 && heap.contains(other)) {
+        heap.remove(other);
+      }
+      if (heap.contains(owner)) {
+        heap.update(owner, costs[owner]);
+      } else {
+        heap.push(owner, costs[owner]);
+      }
+    });
+    collapsed++;
+  }
+  compact();
+  recompute_normals();
+}
+
+#define INSTANTIATE_DECIMATE(Index) \
+  template void BasicMesh<Index>::decimate(size_t, float);
+
+INSTANTIATE_DECIMATE(uint16_t)
+INSTANTIATE_DECIMATE(uint32_t)
+INSTANTIATE_DECIMATE(uint64_t)
@@ -0,0 +1,160 @@
+#include "mesh.hpp"
+#include "parallel.hpp"
+#include "worklist.hpp"
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+// Batched flips and splits. Each operation rewrites a dozen half-edge, face
+// and vertex records, all within the one-rings of its edge's ends and
+// corners, so a Worklist colours the batch into rounds of operations that
+// cannot see each other and each round runs in parallel. The slots a
+// split needs are handed out in request order before the first round: the
+// slots on the free lists first, from the back as push_vertex and
+// push_triangle would take them, then new ones at the end of the arrays.
+// Slots of splits that end up skipped go back to the free lists.
+
+template <class Index>
+bool BasicMesh<Index>::apply_edge_operations(const std::vector<EdgeRequest<Index>>& requests, std::vector<Index>* results){
+  std::vector<Index> applied(requests.size(), 0);
+  auto valid = [&](Index he){
+    return he != 0 && he < this->halfEdges.size() && edge_head(he) != 0;
+  };
+
+  // number the slots each split needs: its vertex and one face per side
+  std::vector<size_t> slots(3 * requests.size(), 0);
+  size_t vertexCount = 0;
+  size_t faceCount = 0;
+  for (size_t j = 0; j < requests.size(); j++) {
+    Index he = requests[j].halfEdge;
+    if (requests[j].operation != SplitEdge || !valid(he)) {
+      continue;
+    }
+    slots[3 * j] = ++vertexCount;
+    slots[3 * j + 1] = ++faceCount;
+    if (edge_pair(he) != 0) {
+      slots[3 * j + 2] = ++faceCount;
+    }
+  }
+  size_t numVertices = this->positions.size();
+  size_t numFaces = num_faces();
+  size_t freeVertexCount = this->freeVertices.size();
+  size_t freeFaceCount = this->freeFaces.size();
+  size_t newVertices = vertexCount > freeVertexCount ? vertexCount - freeVertexCount : 0;
+  size_t newFaces = faceCount > freeFaceCount ? faceCount - freeFaceCount : 0;
+  if (vertexCount != 0 && !fits(numVertices - 1 + newVertices, numFaces + newFaces)) {
+    std::cerr << "Mesh: edge operations do not fit " << 8 * sizeof(Index) << "-bit indices" << std::endl;
+    return false;
+  }
+  invalidate_adjacency();
+  if (vertexCount != 0) {
+    this->positions.resize(numVertices + newVertices);
+    this->normals.resize(numVertices + newVertices);
+    this->vertexHalfEdges.resize(numVertices + newVertices);
+    this->halfEdges.resize(3 * (numFaces + newFaces) + 1);
+  }
+  auto vertexSlot = [&](size_t k){
+    return (Index)(k <= freeVertexCount ? this->freeVertices[freeVertexCount - k] : numVertices + k - 1 - freeVertexCount);
+  };
+  auto faceSlot = [&](size_t k){
+    return (Index)(k <= freeFaceCount ? this->freeFaces[freeFaceCount - k] : numFaces + k - freeFaceCount);
+  };
+  for (size_t j = 0; j < requests.size(); j++) {
+    if (slots[3 * j] != 0) {
+      slots[3 * j] = vertexSlot(slots[3 * j]);
+      slots[3 * j + 1] = faceSlot(slots[3 * j + 1]);
+      slots[3 * j + 2] = slots[3 * j + 2] ? faceSlot(slots[3 * j + 2]) : 0;
+    }
+  }
+  this->freeVertices.resize(freeVertexCount - std::min(vertexCount, freeVertexCount));
+  this->freeFaces.resize(freeFaceCount - std::min(faceCount, freeFaceCount));
+
+  // the new edge must not exist yet
+  auto flippable = [&](Index he){
+    Index pair = edge_pair(he);
+    if (pair == 0) {
+      return false;
+    }
+    Index v2 = edge_head(edge_prev(he));
+    Index v3 = edge_head(edge_prev(pair));
+    if (v2 == v3) {
+      return false;
+    }
+    for (Index u : vertex_neighbours(v2)) {
+      if (u == v3) {
+        return false;
+      }
+    }
+    return true;
+  };
+  auto always = [](Index){
+    return true;
+  };
+  Worklist<Index> work(*this);
+  for (size_t j = 0; j < requests.size(); j++) {
+    if (valid(requests[j].halfEdge)) {
+      work.push(requests[j].halfEdge, j);
+    }
+  }
+  // set_face cannot record faces from several threads, so the faces of a
+  // round are recorded for update_normals after it
+  bool tracking = this->normalsValid;
+  std::vector<Index> changed;
+  while (work.select(always, always)) {
+    const std::vector<Index>& picked = work.picked;
+    const std::vector<size_t>& items = work.items;
+    changed.assign(4 * picked.size(), 0);
+    this->normalsValid = false;
+    parallel_for(picked.size(), [&](size_t i){
+      Index he = picked[i];
+      size_t j = items[i];
+      Index pair = edge_pair(he);
+      Index f0 = edge_left(he);
+      Index f1 = pair ? edge_left(pair) : 0;
+      if (requests[j].operation == SplitEdge) {
+        split_edge(he, slots[3 * j], slots[3 * j + 1], slots[3 * j + 2]);
+        applied[j] = slots[3 * j];
+        changed[4 * i + 2] = slots[3 * j + 1];
+        changed[4 * i + 3] = slots[3 * j + 2];
+      } else {
+        if (!flippable(he)) {
+          return;
+        }
+        flip_edge(he);
+        applied[j] = face_halfEdge(f0);
+      }
+      changed[4 * i] = f0;
+      changed[4 * i + 1] = f1;
+    });
+    this->normalsValid = tracking;
+    for (Index f : changed) {
+      if (f != 0) {
+        touch_face(f);
+      }
+    }
+    tracking = this->normalsValid;
+  }
+
+  for (size_t j = 0; j < requests.size(); j++) {
+    if (slots[3 * j] != 0 && applied[j] == 0) {
+      Index v = slots[3 * j];
+      vertex_halfEdge(v) = deletedIndex;
+      this->freeVertices.push_back(v);
+      this->freeFaces.push_back(slots[3 * j + 1]);
+      if (slots[3 * j + 2] != 0) {
+        this->freeFaces.push_back(slots[3 * j + 2]);
+      }
+    }
+  }
+  if (results) {
+    results->swap(applied);
+  }
+  return true;
+}
+
+#define INSTANTIATE_EDGE_BATCH(Index) \
+  template bool BasicMesh<Index>::apply_edge_operations(const std::vector<EdgeRequest<Index>>&, std::vector<Index>*);
+
+INSTANTIATE_EDGE_BATCH(uint16_t)
+INSTANTIATE_EDGE_BATCH(uint32_t)
+INSTANTIATE_EDGE_BATCH(uint64_t)
@@ -0,0 +1,310 @@
+#include "kernels.hpp"
+#include <cmath>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define KERNELS_X86 1
+#include <immintrin.h>
+#else
+#define KERNELS_X86 0
+#endif
+
+namespace {
+
+SimdLevel detect_simd_level(){
+#if KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return SimdAVX2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return SimdSSE4;
+  }
+#endif
+  return SimdScalar;
+}
+
+// Scalar versions, one element at a time in the same operation order as
+// the vector ones
+
+void smooth_step_scalar(const PaddedAdjacency& adj, const PackedVec3& in, PackedVec3& out, float lambda, size_t first, size_t last){
+  for (size_t s = first; s < last; s++) {
+    size_t base = adj.sliceOffsets[s];
+    size_t width = (adj.sliceOffsets[s + 1] - base) / simdLanes;
+    for (size_t l = 0; l < simdLanes; l++) {
+      size_t v = s * simdLanes + l;
+      float degree = adj.degree[v];
+      if (degree == 0) {
+        out.x[v] = in.x[v];
+        out.y[v] = in.y[v];
+        out.z[v] = in.z[v];
+        continue;
+      }
+      float x = 0, y = 0, z = 0;
+      for (size_t k = 0; k < width; k++) {
+        uint32_t n = adj.slots[base + k * simdLanes + l];
+        x += in.x[n];
+        y += in.y[n];
+        z += in.z[n];
+      }
+      out.x[v] = in.x[v] + lambda * (x / degree - in.x[v]);
+      out.y[v] = in.y[v] + lambda * (y / degree - in.y[v]);
+      out.z[v] = in.z[v] + lambda * (z / degree - in.z[v]);
+    }
+  }
+}
+
+void face_normals_scalar(const float* p, const uint32_t* a, const uint32_t* b, const uint32_t* c, float* nx, float* ny, float* nz, size_t first, size_t last){
+  for (size_t i = first; i < last; i++) {
+    const float* pa = p + 3 * a[i];
+    const float* pb = p + 3 * b[i];
+    const float* pc = p + 3 * c[i];
+    float e1x = pb[0] - pa[0], e1y = pb[1] - pa[1], e1z = pb[2] - pa[2];
+    float e2x = pc[0] - pa[0], e2y = pc[1] - pa[1], e2z = pc[2] - pa[2];
+    float l1 = std::sqrt(e1x * e1x + e1y * e1y + e1z * e1z);
+    float l2 = std::sqrt(e2x * e2x + e2y * e2y + e2z * e2z);
+    float weight = 1 / l1 / l2;
+    nx[i] = (e1y * e2z - e1z * e2y) * weight * weight;
+    ny[i] = (e1z * e2x - e1x * e2z) * weight * weight;
+    nz[i] = (e1x * e2y - e1y * e2x) * weight * weight;
+  }
+}
+
+void normalize_scalar(float* v, size_t first, size_t last){
+  for (size_t i = first; i < last; i++) {
+    float* n = v + 3 * i;
+    float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    float scale = length != 0.0f ? 1.0f / length : 0.0f;
+    n[0] *= scale;
+    n[1] *= scale;
+    n[2] *= scale;
+  }
+}
+
+#if KERNELS_X86
+
+// SSE4.1 has no gather, so lanes are loaded one by one; blendv picks the
+// unchanged position for isolated vertices
+
+__attribute__((target("sse4.1")))
+inline __m128 gather_sse(const float* base, const uint32_t* idx){
+  return _mm_set_ps(base[idx[3]], base[idx[2]], base[idx[1]], base[idx[0]]);
+}
+
+__attribute__((target("sse4.1")))
+void smooth_step_sse4(const PaddedAdjacency& adj, const PackedVec3& in, PackedVec3& out, float lambda, size_t first, size_t last){
+  __m128 lam = _mm_set1_ps(lambda);
+  for (size_t s = first; s < last; s++) {
+    size_t base = adj.sliceOffsets[s];
+    size_t width = (adj.sliceOffsets[s + 1] - base) / simdLanes;
+    for (size_t h = 0; h < simdLanes; h += 4) {
+      size_t v = s * simdLanes + h;
+      __m128 x = _mm_setzero_ps(), y = _mm_setzero_ps(), z = _mm_setzero_ps();
+      for (size_t k = 0; k < width; k++) {
+        const uint32_t* idx = &adj.slots[base + k * simdLanes + h];
+        x = _mm_add_ps(x, gather_sse(in.x.data(), idx));
+        y = _mm_add_ps(y, gather_sse(in.y.data(), idx));
+        z = _mm_add_ps(z, gather_sse(in.z.data(), idx));
+      }
+      __m128 degree = _mm_load_ps(&adj.degree[v]);
+      __m128 isolated = _mm_cmpeq_ps(degree, _mm_setzero_ps());
+      __m128 px = _mm_load_ps(&in.x[v]), py = _mm_load_ps(&in.y[v]), pz = _mm_load_ps(&in.z[v]);
+      x = _mm_add_ps(px, _mm_mul_ps(lam, _mm_sub_ps(_mm_div_ps(x, degree), px)));
+      y = _mm_add_ps(py, _mm_mul_ps(lam, _mm_sub_ps(_mm_div_ps(y, degree), py)));
+      z = _mm_add_ps(pz, _mm_mul_ps(lam, _mm_sub_ps(_mm_div_ps(z, degree), pz)));
+      _mm_store_ps(&out.x[v], _mm_blendv_ps(x, px, isolated));
+      _mm_store_ps(&out.y[v], _mm_blendv_ps(y, py, isolated));
+      _mm_store_ps(&out.z[v], _mm_blendv_ps(z, pz, isolated));
+    }
+  }
+}
+
+// one coordinate of four vertices stored as x, y, z
+__attribute__((target("sse4.1")))
+inline __m128 gather3_sse(const float* p, const uint32_t* idx){
+  return _mm_set_ps(p[3 * idx[3]], p[3 * idx[2]], p[3 * idx[1]], p[3 * idx[0]]);
+}
+
+__attribute__((target("sse4.1")))
+void face_normals_sse4(const float* p, const uint32_t* a, const uint32_t* b, const uint32_t* c, float* nx, float* ny, float* nz, size_t count){
+  __m128 one = _mm_set1_ps(1.0f);
+  for (size_t i = 0; i < count; i += 4) {
+    __m128 ax = gather3_sse(p, a + i), ay = gather3_sse(p + 1, a + i), az = gather3_sse(p + 2, a + i);
+    __m128 e1x = _mm_sub_ps(gather3_sse(p, b + i), ax);
+    __m128 e1y = _mm_sub_ps(gather3_sse(p + 1, b + i), ay);
+    __m128 e1z = _mm_sub_ps(gather3_sse(p + 2, b + i), az);
+    __m128 e2x = _mm_sub_ps(gather3_sse(p, c + i), ax);
+    __m128 e2y = _mm_sub_ps(gather3_sse(p + 1, c + i), ay);
+    __m128 e2z = _mm_sub_ps(gather3_sse(p + 2, c + i), az);
+    __m128 l1 = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, e1x), _mm_mul_ps(e1y, e1y)), _mm_mul_ps(e1z, e1z)));
+    __m128 l2 = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, e2x), _mm_mul_ps(e2y, e2y)), _mm_mul_ps(e2z, e2z)));
+    __m128 weight = _mm_div_ps(_mm_div_ps(one, l1), l2);
+    __m128 x = _mm_sub_ps(_mm_mul_ps(e1y, e2z), _mm_mul_ps(e1z, e2y));
+    __m128 y = _mm_sub_ps(_mm_mul_ps(e1z, e2x), _mm_mul_ps(e1x, e2z));
+    __m128 z = _mm_sub_ps(_mm_mul_ps(e1x, e2y), _mm_mul_ps(e1y, e2x));
+    _mm_store_ps(nx + i, _mm_mul_ps(_mm_mul_ps(x, weight), weight));
+    _mm_store_ps(ny + i, _mm_mul_ps(_mm_mul_ps(y, weight), weight));
+    _mm_store_ps(nz + i, _mm_mul_ps(_mm_mul_ps(z, weight), weight));
+  }
+}
+
+// Four vectors are three consecutive registers; the scale of each vector
+// is spread over its three floats with shuffles
+__attribute__((target("sse4.1")))
+void normalize_sse4(float* v, size_t first, size_t last){
+  __m128 one = _mm_set1_ps(1.0f);
+  size_t i = first;
+  for (; i + 4 <= last; i += 4) {
+    float* n = v + 3 * i;
+    __m128 x = _mm_set_ps(n[9], n[6], n[3], n[0]);
+    __m128 y = _mm_set_ps(n[10], n[7], n[4], n[1]);
+    __m128 z = _mm_set_ps(n[11], n[8], n[5], n[2]);
+    __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+    __m128 scale = _mm_and_ps(_mm_div_ps(one, length), _mm_cmpneq_ps(length, _mm_setzero_ps()));
+    _mm_storeu_ps(n, _mm_mul_ps(_mm_loadu_ps(n), _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(1, 0, 0, 0))));
+    _mm_storeu_ps(n + 4, _mm_mul_ps(_mm_loadu_ps(n + 4), _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(2, 2, 1, 1))));
+    _mm_storeu_ps(n + 8, _mm_mul_ps(_mm_loadu_ps(n + 8), _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(3, 3, 3, 2))));
+  }
+  normalize_scalar(v, i, last);
+}
+
+// AVX2 versions use the hardware gather with 32-bit indices
+
+__attribute__((target("avx2")))
+void smooth_step_avx2(const PaddedAdjacency& adj, const PackedVec3& in, PackedVec3& out, float lambda, size_t first, size_t last){
+  __m256 lam = _mm256_set1_ps(lambda);
+  for (size_t s = first; s < last; s++) {
+    size_t base = adj.sliceOffsets[s];
+    size_t width = (adj.sliceOffsets[s + 1] - base) / simdLanes;
+    size_t v = s * simdLanes;
+    __m256 x = _mm256_setzero_ps(), y = _mm256_setzero_ps(), z = _mm256_setzero_ps();
+    for (size_t k = 0; k < width; k++) {
+      __m256i idx = _mm256_loadu_si256((const __m256i*)&adj.slots[base + k * simdLanes]);
+      x = _mm256_add_ps(x, _mm256_i32gather_ps(in.x.data(), idx, 4));
+      y = _mm256_add_ps(y, _mm256_i32gather_ps(in.y.data(), idx, 4));
+      z = _mm256_add_ps(z, _mm256_i32gather_ps(in.z.data(), idx, 4));
+    }
+    __m256 degree = _mm256_load_ps(&adj.degree[v]);
+    __m256 isolated = _mm256_cmp_ps(degree, _mm256_setzero_ps(), _CMP_EQ_OQ);
+    __m256 px = _mm256_load_ps(&in.x[v]), py = _mm256_load_ps(&in.y[v]), pz = _mm256_load_ps(&in.z[v]);
+    x = _mm256_add_ps(px, _mm256_mul_ps(lam, _mm256_sub_ps(_mm256_div_ps(x, degree), px)));
+    y = _mm256_add_ps(py, _mm256_mul_ps(lam, _mm256_sub_ps(_mm256_div_ps(y, degree), py)));
+    z = _mm256_add_ps(pz, _mm256_mul_ps(lam, _mm256_sub_ps(_mm256_div_ps(z, degree), pz)));
+    _mm256_store_ps(&out.x[v], _mm256_blendv_ps(x, px, isolated));
+    _mm256_store_ps(&out.y[v], _mm256_blendv_ps(y, py, isolated));
+    _mm256_store_ps(&out.z[v], _mm256_blendv_ps(z, pz, isolated));
+  }
+}
+
+__attribute__((target("avx2")))
+void face_normals_avx2(const float* p, const uint32_t* a, const uint32_t* b, const uint32_t* c, float* nx, float* ny, float* nz, size_t count){
+  __m256 one = _mm256_set1_ps(1.0f);
+  for (size_t i = 0; i < count; i += simdLanes) {
+    // float offsets of the corners, 3 per vertex
+    __m256i ia = _mm256_load_si256((const __m256i*)(a + i));
+    __m256i ib = _mm256_load_si256((const __m256i*)(b + i));
+    __m256i ic = _mm256_load_si256((const __m256i*)(c + i));
+    ia = _mm256_add_epi32(ia, _mm256_add_epi32(ia, ia));
+    ib = _mm256_add_epi32(ib, _mm256_add_epi32(ib, ib));
+    ic = _mm256_add_epi32(ic, _mm256_add_epi32(ic, ic));
+    __m256 ax = _mm256_i32gather_ps(p, ia, 4);
+    __m256 ay = _mm256_i32gather_ps(p + 1, ia, 4);
+    __m256 az = _mm256_i32gather_ps(p + 2, ia, 4);
+    __m256 e1x = _mm256_sub_ps(_mm256_i32gather_ps(p, ib, 4), ax);
+    __m256 e1y = _mm256_sub_ps(_mm256_i32gather_ps(p + 1, ib, 4), ay);
+    __m256 e1z = _mm256_sub_ps(_mm256_i32gather_ps(p + 2, ib, 4), az);
+    __m256 e2x = _mm256_sub_ps(_mm256_i32gather_ps(p, ic, 4), ax);
+    __m256 e2y = _mm256_sub_ps(_mm256_i32gather_ps(p + 1, ic, 4), ay);
+    __m256 e2z = _mm256_sub_ps(_mm256_i32gather_ps(p + 2, ic, 4), az);
+    __m256 l1 = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, e1x), _mm256_mul_ps(e1y, e1y)), _mm256_mul_ps(e1z, e1z)));
+    __m256 l2 = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, e2x), _mm256_mul_ps(e2y, e2y)), _mm256_mul_ps(e2z, e2z)));
+    __m256 weight = _mm256_div_ps(_mm256_div_ps(one, l1), l2);
+    __m256 x = _mm256_sub_ps(_mm256_mul_ps(e1y, e2z), _mm256_mul_ps(e1z, e2y));
+    __m256 y = _mm256_sub_ps(_mm256_mul_ps(e1z, e2x), _mm256_mul_ps(e1x, e2z));
+    __m256 z = _mm256_sub_ps(_mm256_mul_ps(e1x, e2y), _mm256_mul_ps(e1y, e2x));
+    _mm256_store_ps(nx + i, _mm256_mul_ps(_mm256_mul_ps(x, weight), weight));
+    _mm256_store_ps(ny + i, _mm256_mul_ps(_mm256_mul_ps(y, weight), weight));
+    _mm256_store_ps(nz + i, _mm256_mul_ps(_mm256_mul_ps(z, weight), weight));
+  }
+}
+
+// Eight vectors are three consecutive registers, split into x, y and z
+// with in-lane shuffles (each 128-bit half holds four whole vectors); the
+// scale of each vector is then spread back over its three floats
+__attribute__((target("avx2")))
+void normalize_avx2(float* v, size_t first, size_t last){
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256i spread0 = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+  __m256i spread1 = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+  __m256i spread2 = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+  size_t i = first;
+  for (; i + simdLanes <= last; i += simdLanes) {
+    float* n = v + 3 * i;
+    __m256 m03 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(n)), _mm_loadu_ps(n + 12), 1);
+    __m256 m14 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(n + 4)), _mm_loadu_ps(n + 16), 1);
+    __m256 m25 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(n + 8)), _mm_loadu_ps(n + 20), 1);
+    __m256 xy = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2));
+    __m256 yz = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1));
+    __m256 x = _mm256_shuffle_ps(m03, xy, _MM_SHUFFLE(2, 0, 3, 0));
+    __m256 y = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+    __m256 z = _mm256_shuffle_ps(yz, m25, _MM_SHUFFLE(3, 0, 3, 1));
+    __m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)));
+    __m256 scale = _mm256_and_ps(_mm256_div_ps(one, length), _mm256_cmp_ps(length, _mm256_setzero_ps(), _CMP_NEQ_UQ));
+    _mm256_storeu_ps(n, _mm256_mul_ps(_mm256_loadu_ps(n), _mm256_permutevar8x32_ps(scale, spread0)));
+    _mm256_storeu_ps(n + 8, _mm256_mul_ps(_mm256_loadu_ps(n + 8), _mm256_permutevar8x32_ps(scale, spread1)));
+    _mm256_storeu_ps(n + 16, _mm256_mul_ps(_mm256_loadu_ps(n + 16), _mm256_permutevar8x32_ps(scale, spread2)));
+  }
+  normalize_scalar(v, i, last);
+}
+
+#endif
+
+}
+
+SimdLevel& simd_level(){
+  static SimdLevel level = detect_simd_level();
+  return level;
+}
+
+const char* simd_name(SimdLevel level){
+  switch (level) {
+    case SimdAVX2: return "avx2";
+    case SimdSSE4: return "sse4.1";
+    default: return "scalar";
+  }
+}
+
+void smooth_step(const PaddedAdjacency& adj, const PackedVec3& in, PackedVec3& out, float lambda, size_t first, size_t last){
+#if KERNELS_X86
+  if (simd_level() == SimdAVX2) {
+    return smooth_step_avx2(adj, in, out, lambda, first, last);
+  }
+  if (simd_level() == SimdSSE4) {
+    return smooth_step_sse4(adj, in, out, lambda, first, last);
+  }
+#endif
+  smooth_step_scalar(adj, in, out, lambda, first, last);
+}
+
+void face_normals(const float* positions, const uint32_t* a, const uint32_t* b, const uint32_t* c, float* nx, float* ny, float* nz, size_t count){
+#if KERNELS_X86
+  if (simd_level() == SimdAVX2) {
+    return face_normals_avx2(positions, a, b, c, nx, ny, nz, count);
+  }
+  if (simd_level() == SimdSSE4) {
+    return face_normals_sse4(positions, a, b, c, nx, ny, nz, count);
+  }
+#endif
+  face_normals_scalar(positions, a, b, c, nx, ny, nz, 0, count);
+}
+
+void normalize_vectors(float* v, size_t count){
+#if KERNELS_X86
+  if (simd_level() == SimdAVX2) {
+    return normalize_avx2(v, 0, count);
+  }
+  if (simd_level() == SimdSSE4) {
+    return normalize_sse4(v, 0, count);
+  }
+#endif
+  normalize_scalar(v, 0, count);
+}
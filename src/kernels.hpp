@@ -0,0 +1,120 @@
+#pragma once
+#include "buffer.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <glm/glm.hpp>
+
+// Vectorized kernels behind the mesh geometry passes. Each kernel has a
+// scalar, an SSE4.1 and an AVX2 version; the widest one the CPU supports is
+// picked at run time. All versions do the same float operations in the
+// same order (no FMA, no reciprocal approximations), so they give
+// bit-identical results.
+enum SimdLevel { SimdScalar, SimdSSE4, SimdAVX2 };
+
+// Level the kernels run at. Defaults to the widest supported one and may be
+// lowered, e.g. to compare kernels; raising it past the CPU is not checked.
+SimdLevel& simd_level();
+const char* simd_name(SimdLevel level);
+
+// Kernels work on groups of this many consecutive elements
+const size_t simdLanes = 8;
+
+inline size_t simd_round_up(size_t n){
+  return (n + simdLanes - 1) / simdLanes * simdLanes;
+}
+
+// vec3 array split into x, y and z arrays. count is rounded up to whole
+// lane groups and followed by one more group of zeros; index `zero` (==
+// count) is the first of them and serves as padding for gathers.
+struct PackedVec3
+{
+    Buffer<float> x;
+    Buffer<float> y;
+    Buffer<float> z;
+    size_t count = 0;
+    size_t zero = 0;
+
+    void resize(size_t n){
+      this->count = simd_round_up(n);
+      this->zero = this->count;
+      this->x = Buffer<float>(this->count + simdLanes);
+      this->y = Buffer<float>(this->count + simdLanes);
+      this->z = Buffer<float>(this->count + simdLanes);
+    }
+    void pack(const glm::vec3* v, size_t n){
+      resize(n);
+      parallel_for(n, [&](size_t i){
+        this->x[i] = v[i].x;
+        this->y[i] = v[i].y;
+        this->z[i] = v[i].z;
+      });
+    }
+    void unpack(glm::vec3* v, size_t n) const {
+      parallel_for(n, [&](size_t i){
+        v[i] = glm::vec3(this->x[i], this->y[i], this->z[i]);
+      });
+    }
+};
+
+// Vertex adjacency padded to a fixed degree per slice of simdLanes
+// vertices, stored slot-major: neighbour k of vertex 8s + l is at
+// slots[sliceOffsets[s] + 8k + l]. Missing neighbours point at the zero
+// padding element, so a gather adds +0 for them. degree holds the real
+// number of neighbours as a float.
+struct PaddedAdjacency
+{
+    Buffer<size_t> sliceOffsets;
+    Buffer<uint32_t> slots;
+    Buffer<float> degree;
+
+    size_t num_slices() const { return this->sliceOffsets.empty() ? 0 : this->sliceOffsets.size() - 1; }
+};
+
+// Builds the padded adjacency from compressed rows, taking the first
+// offsets[v + 1] - offsets[v] - skip[v] neighbours of every vertex. zero is
+// the padding index. Vertex indices must fit in 31 bits for the gathers.
+template <class Index>
+void pad_adjacency(const size_t* offsets, const Index* neighbours, const uint8_t* skip, size_t numVertices, uint32_t zero, PaddedAdjacency& out){
+  size_t numSlices = simd_round_up(numVertices) / simdLanes;
+  out.sliceOffsets = Buffer<size_t>(numSlices + 1);
+  out.degree = Buffer<float>(numSlices * simdLanes);
+  parallel_for(numSlices, [&](size_t s){
+    size_t width = 0;
+    for (size_t v = s * simdLanes; v < std::min(numVertices, (s + 1) * simdLanes); v++) {
+      width = std::max<size_t>(width, offsets[v + 1] - offsets[v] - skip[v]);
+    }
+    out.sliceOffsets[s + 1] = width * simdLanes;
+  });
+  out.sliceOffsets[0] = 0;
+  for (size_t s = 0; s < numSlices; s++) {
+    out.sliceOffsets[s + 1] += out.sliceOffsets[s];
+  }
+  out.slots = Buffer<uint32_t>(out.sliceOffsets[numSlices]);
+  parallel_for(numSlices, [&](size_t s){
+    size_t base = out.sliceOffsets[s];
+    size_t width = (out.sliceOffsets[s + 1] - base) / simdLanes;
+    for (size_t l = 0; l < simdLanes; l++) {
+      size_t v = s * simdLanes + l;
+      size_t degree = v < numVertices ? offsets[v + 1] - offsets[v] - skip[v] : 0;
+      out.degree[v] = (float)degree;
+      for (size_t k = 0; k < width; k++) {
+        out.slots[base + k * simdLanes + l] = k < degree ? (uint32_t)neighbours[offsets[v] + k] : zero;
+      }
+    }
+  });
+}
+
+// One Laplacian step on slices [first, last):
+// out = p + lambda * (mean of the neighbours - p), or p for isolated vertices
+void smooth_step(const PaddedAdjacency& adj, const PackedVec3& in, PackedVec3& out, float lambda, size_t first, size_t last);
+
+// Area weighted normals cross(b - a, c - a) / |b - a|^2 / |c - a|^2 of the
+// triangles (a[i], b[i], c[i]), i < count, into nx, ny and nz. positions
+// holds x, y, z per vertex. count is a whole number of lane groups and all
+// six arrays are 32-byte aligned.
+void face_normals(const float* positions, const uint32_t* a, const uint32_t* b, const uint32_t* c, float* nx, float* ny, float* nz, size_t count);
+
+// Normalizes count vectors stored as x, y, z in place; zero vectors stay zero
+void normalize_vectors(float* v, size_t count);
@@ -0,0 +1,443 @@
+#include "mesh.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <glm/geometric.hpp>
+#include <unordered_map>
+#include <vector>
+
+// Loop limit surface for the rules loop_subdivision uses: old interior
+// vertices move with weight u = 3/16 for valence 3 and 3/(8n) otherwise,
+// edge points are 3/8, 3/8, 1/8, 1/8, boundary edge points are midpoints,
+// and a boundary vertex applies the interior rule to its outgoing ring (the
+// last neighbour of the ring, across the incoming boundary edge, is left out).
+
+namespace {
+
+// Faces deeper than this below the control mesh are not refined further;
+// what is left of an irregular face is interpolated from its corners
+const int maxLimitDepth = 16;
+
+// Iterations on the boundary one-ring, each shrinks it by about half
+const int boundaryIterations = 64;
+
+// Quartic box spline basis of a regular patch (Stam, "Evaluation of Loop
+// subdivision surfaces"), as coefficients / 12 of the monomials
+// u^a v^b w^c, a + b + c = 4, in the order of monomialPowers. The patch
+// corners u = 1, v = 1 and w = 1 are control points 3, 6 and 7 (0-based):
+//
+//      0   1
+//    2   3   4
+//  5   6   7   8
+//    9  10  11
+const int monomialPowers[15][3] = {
+  {4, 0, 0}, {3, 1, 0}, {3, 0, 1}, {2, 2, 0}, {2, 1, 1},
+  {2, 0, 2}, {1, 3, 0}, {1, 2, 1}, {1, 1, 2}, {1, 0, 3},
+  {0, 4, 0}, {0, 3, 1}, {0, 2, 2}, {0, 1, 3}, {0, 0, 4},
+};
+const float boxSpline[12][15] = {
+  // u4 u3v u3w u2v2 u2vw u2w2 uv3 uv2w uvw2 uw3 v4 v3w v2w2 vw3 w4
+  {1, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+  {1, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
+  {1, 6, 2, 12, 6, 0, 6, 6, 0, 0, 1, 2, 0, 0, 0},
+  {6, 24, 24, 24, 60, 24, 8, 36, 36, 8, 1, 6, 12, 6, 1},
+  {1, 2, 6, 0, 6, 12, 0, 0, 6, 6, 0, 0, 0, 2, 1},
+  {0, 0, 0, 0, 0, 0, 2, 0, 0, 0, 1, 0, 0, 0, 0},
+  {1, 8, 6, 24, 36, 12, 24, 60, 36, 6, 6, 24, 24, 8, 1},
+  {1, 6, 8, 12, 36, 24, 6, 36, 60, 24, 1, 8, 24, 24, 6},
+  {0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0, 0, 1},
+  {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 0, 0, 0},
+  {0, 0, 0, 0, 0, 0, 2, 6, 6, 2, 1, 6, 12, 6, 1},
+  {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 1},
+};
+
+float power(float x, int n){
+  float r = 1.0f;
+  for (int i = 0; i < n; i++) {
+    r *= x;
+  }
+  return r;
+}
+
+glm::vec3 unit(const glm::vec3& v){
+  float length = glm::length(v);
+  return length > 0.0f ? v / length : glm::vec3(0.0f);
+}
+
+// Limit position and the tangents along u and v (w = 1 - u - v) of a
+// regular patch with control points p at barycentric coordinates b
+void eval_box_spline(const glm::vec3* p, const glm::vec3& b, glm::vec3& position, glm::vec3& du, glm::vec3& dv){
+  float value[15], dU[15], dV[15], dW[15];
+  for (int m = 0; m < 15; m++) {
+    const int* e = monomialPowers[m];
+    float pu = power(b.x, e[0]), pv = power(b.y, e[1]), pw = power(b.z, e[2]);
+    value[m] = pu * pv * pw;
+    dU[m] = e[0] ? e[0] * power(b.x, e[0] - 1) * pv * pw : 0.0f;
+    dV[m] = e[1] ? e[1] * pu * power(b.y, e[1] - 1) * pw : 0.0f;
+    dW[m] = e[2] ? e[2] * pu * pv * power(b.z, e[2] - 1) : 0.0f;
+  }
+  position = du = dv = glm::vec3(0.0f);
+  for (int i = 0; i < 12; i++) {
+    float basis = 0.0f, basisU = 0.0f, basisV = 0.0f;
+    for (int m = 0; m < 15; m++) {
+      basis += boxSpline[i][m] * value[m];
+      basisU += boxSpline[i][m] * (dU[m] - dW[m]);
+      basisV += boxSpline[i][m] * (dV[m] - dW[m]);
+    }
+    position += basis / 12.0f * p[i];
+    du += basisU / 12.0f * p[i];
+    dv += basisV / 12.0f * p[i];
+  }
+}
+
+template <class Index>
+bool regular_vertex(BasicMesh<Index>& mesh, Index v){
+  Index start = mesh.vertex_halfEdge(v);
+  if (start == 0 || mesh.edge_pair(mesh.edge_prev(start)) == 0) {
+    return false;
+  }
+  int count = 0;
+  for (Index he : mesh.vertex_outgoing(v)) {
+    (void)he;
+    count++;
+  }
+  return count == 6;
+}
+
+// The ring of interior vertex v after a, continuing away from b, where a
+// and b are consecutive neighbours
+template <class Index>
+void ring_after(BasicMesh<Index>& mesh, Index v, Index a, Index b, Index* out, int count){
+  Index ring[6];
+  int n = 0;
+  for (Index u : mesh.vertex_neighbours(v)) {
+    ring[n++] = u;
+  }
+  int i = std::find(ring, ring + 6, a) - ring;
+  int step = ring[(i + 5) % 6] == b ? 1 : 5;
+  for (int k = 0; k < count; k++) {
+    out[k] = ring[(i + (k + 1) * step) % 6];
+  }
+}
+
+// Control points of face f if all its corners are interior with valence 6
+template <class Index>
+bool regular_patch(BasicMesh<Index>& mesh, Index f, glm::vec3* p){
+  std::array<Index, 3> c = mesh.face_vertices(f);
+  for (Index v : c) {
+    if (!regular_vertex(mesh, v)) {
+      return false;
+    }
+  }
+  Index r0[4], r1[4], r2[4];
+  ring_after(mesh, c[0], c[1], c[2], r0, 4);
+  ring_after(mesh, c[1], c[2], c[0], r1, 4);
+  ring_after(mesh, c[2], c[0], c[1], r2, 4);
+  Index points[12] = {r0[1], r0[2], r0[0], c[0], r0[3], r1[2], c[1], c[2], r2[1], r1[1], r1[0], r2[2]};
+  const glm::vec3* positions = mesh.vertex_positions().data();
+  for (int i = 0; i < 12; i++) {
+    p[i] = positions[points[i]];
+  }
+  return true;
+}
+
+// Limit position and unit normal of vertex v
+template <class Index>
+void vertex_limit(BasicMesh<Index>& mesh, Index v, glm::vec3& position, glm::vec3& normal){
+  const glm::vec3* positions = mesh.vertex_positions().data();
+  Index start = mesh.vertex_halfEdge(v);
+  position = positions[v];
+  normal = glm::vec3(0.0f);
+  if (start == 0) {
+    return;
+  }
+  std::vector<glm::vec3> ring;
+  for (Index u : mesh.vertex_neighbours(v)) {
+    ring.push_back(positions[u]);
+  }
+  if (mesh.edge_pair(mesh.edge_prev(start)) != 0) {
+    // Interior: the eigenvectors of the subdivision matrix give the limit
+    // point (n p + sum q) / 2n, or (2 p + sum q) / 5 for valence 3, and the
+    // tangents sum cos(2 pi i / n) q_i and sum sin(2 pi i / n) q_i. The
+    // cosines and sines sum to zero, so offsets from p give the same
+    // tangents without cancelling large coordinates.
+    int n = ring.size();
+    glm::vec3 sum(0.0f), t1(0.0f), t2(0.0f);
+    for (int i = 0; i < n; i++) {
+      float angle = 2.0f * 3.14159265f * i / n;
+      glm::vec3 offset = ring[i] - positions[v];
+      sum += offset;
+      t1 += std::cos(angle) * offset;
+      t2 += std::sin(angle) * offset;
+    }
+    float weight = n == 3 ? 2.0f : (float)n;
+    position = positions[v] + sum / (weight + n);
+    // the ring runs clockwise around the face normals
+    normal = glm::cross(t2, t1);
+    normal = unit(normal);
+    return;
+  }
+  // Boundary: the outgoing ring q_0..q_{f-1} plus the last neighbour x
+  // maps onto itself under subdivision. As offsets from the vertex the
+  // step is linear, q' = S q: edges to q_{f-1} and x are on the boundary,
+  // the others lie between q_{i-1} and q_{i+1} (x comes before q_0), and
+  // the vertex moves by u times the sum of the outgoing ring.
+  int f = ring.size() - 1;
+  int size = f + 1;
+  double u = f == 3 ? 3.0 / 16.0 : 3.0 / (8.0 * f);
+  std::vector<double> S(size * size, 0.0);
+  for (int i = 0; i < size; i++) {
+    double* row = &S[i * size];
+    if (i >= f - 1) {
+      row[i] += 0.5;
+    } else {
+      row[i] += 3.0 / 8.0;
+      row[i == 0 ? f : i - 1] += 1.0 / 8.0;
+      row[i + 1] += 1.0 / 8.0;
+    }
+    for (int j = 0; j < f; j++) {
+      row[j] -= u;
+    }
+  }
+  std::vector<glm::dvec3> q(size), next(size);
+  for (int i = 0; i < size; i++) {
+    q[i] = glm::dvec3(ring[i]) - glm::dvec3(positions[v]);
+  }
+  // the limit point: subdivide the ring until it has shrunk onto it
+  glm::dvec3 p(positions[v]), moved(0.0);
+  std::vector<glm::dvec3> current = q;
+  for (int it = 0; it < boundaryIterations; it++) {
+    for (int j = 0; j < f; j++) {
+      moved += u * current[j];
+    }
+    for (int i = 0; i < size; i++) {
+      next[i] = glm::dvec3(0.0);
+      for (int j = 0; j < size; j++) {
+        next[i] += S[i * size + j] * current[j];
+      }
+    }
+    current.swap(next);
+  }
+  position = glm::vec3(p + moved);
+  // The tangents are the ring weighted by the left eigenvectors of the two
+  // largest eigenvalues of S. Orthogonal iteration on S^T finds the plane
+  // they span, which is all the normal needs.
+  std::vector<double> a(size), b(size), na(size), nb(size);
+  for (int i = 0; i < size; i++) {
+    a[i] = std::cos(3.14159265 * i / f);
+    b[i] = std::sin(3.14159265 * i / f);
+  }
+  for (int it = 0; it < boundaryIterations; it++) {
+    for (int j = 0; j < size; j++) {
+      na[j] = nb[j] = 0.0;
+      for (int i = 0; i < size; i++) {
+        na[j] += S[i * size + j] * a[i];
+        nb[j] += S[i * size + j] * b[i];
+      }
+    }
+    double aa = 0.0, ab = 0.0, bb = 0.0;
+    for (int i = 0; i < size; i++) {
+      aa += na[i] * na[i];
+    }
+    for (int i = 0; i < size; i++) {
+      na[i] /= std::sqrt(aa);
+      ab += na[i] * nb[i];
+    }
+    for (int i = 0; i < size; i++) {
+      nb[i] -= ab * na[i];
+      bb += nb[i] * nb[i];
+    }
+    for (int i = 0; i < size; i++) {
+      nb[i] /= std::sqrt(bb);
+    }
+    a.swap(na);
+    b.swap(nb);
+  }
+  glm::dvec3 t1(0.0), t2(0.0), faces = glm::cross(q[0], q[f]);
+  for (int i = 0; i < size; i++) {
+    t1 += a[i] * q[i];
+    t2 += b[i] * q[i];
+  }
+  // faces (v, q_0, x) and (v, q_i, q_{i-1}) orient the plane
+  for (int i = 1; i < f; i++) {
+    faces += glm::cross(q[i], q[i - 1]);
+  }
+  glm::dvec3 n = glm::cross(t1, t2);
+  if (glm::dot(n, faces) < 0.0) {
+    n = -n;
+  }
+  double length = glm::length(n);
+  normal = length > 0.0 ? glm::vec3(n / length) : glm::vec3(0.0f);
+}
+
+// Copies the faces around face f into patch, face f first with its corners
+// in order: every face touching a vertex within two rings of f's corners.
+// After one subdivision step the patch is still exact within two rings of
+// the children of f, which is what the next step needs.
+template <class Index>
+void extract_patch(BasicMesh<Index>& mesh, Index f, Mesh& patch){
+  std::unordered_map<Index, int> distance;
+  std::vector<Index> front;
+  for (Index v : mesh.face_vertices(f)) {
+    if (distance.emplace(v, 0).second) {
+      front.push_back(v);
+    }
+  }
+  std::vector<Index> inner = front;
+  for (int d = 1; d <= 2; d++) {
+    std::vector<Index> ring;
+    for (Index v : front) {
+      for (Index u : mesh.vertex_neighbours(v)) {
+        if (distance.emplace(u, d).second) {
+          ring.push_back(u);
+        }
+      }
+    }
+    inner.insert(inner.end(), ring.begin(), ring.end());
+    front.swap(ring);
+  }
+  std::vector<Index> faces(1, f);
+  for (Index v : inner) {
+    for (Index g : mesh.vertex_faces(v)) {
+      if (g != f) {
+        faces.push_back(g);
+      }
+    }
+  }
+  std::sort(faces.begin() + 1, faces.end());
+  faces.erase(std::unique(faces.begin() + 1, faces.end()), faces.end());
+
+  std::unordered_map<Index, int> local;
+  std::vector<glm::vec3> vertices;
+  std::vector<glm::ivec3> triangles;
+  const glm::vec3* positions = mesh.vertex_positions().data();
+  for (Index g : faces) {
+    std::array<Index, 3> c = mesh.face_vertices(g);
+    glm::ivec3 t;
+    for (int k = 0; k < 3; k++) {
+      auto inserted = local.emplace(c[k], (int)vertices.size());
+      if (inserted.second) {
+        vertices.push_back(positions[c[k]]);
+      }
+      t[k] = inserted.first->second;
+    }
+    triangles.push_back(t);
+  }
+  patch.init(vertices.data(), vertices.size(), nullptr, 0, triangles.data(), triangles.size());
+}
+
+// A point to evaluate: barycentric weights in the face being refined and
+// where its results go
+struct LimitSample
+{
+    glm::vec3 b;
+    size_t index;
+};
+
+// Limit positions and unit normals of samples in face f. Regular faces are
+// evaluated as box splines; others are refined on a local patch and the
+// samples handed to the children of f that hold them, until they land in
+// regular faces. Patch face 1 is always the face being refined, so its
+// children are faces 1, 2, 3 (corners) and 4 (middle).
+template <class Index>
+void limit_samples(BasicMesh<Index>& mesh, Index f, std::vector<LimitSample>& samples, int depth, glm::vec3* positions, glm::vec3* normals){
+  glm::vec3 p[12];
+  if (regular_patch(mesh, f, p)) {
+    for (const LimitSample& sample : samples) {
+      glm::vec3 du, dv;
+      eval_box_spline(p, sample.b, positions[sample.index], du, dv);
+      normals[sample.index] = unit(glm::cross(du, dv));
+    }
+    return;
+  }
+  std::array<Index, 3> c = mesh.face_vertices(f);
+  glm::vec3 cornerPosition[3], cornerNormal[3];
+  for (int k = 0; k < 3; k++) {
+    vertex_limit(mesh, c[k], cornerPosition[k], cornerNormal[k]);
+  }
+  std::vector<LimitSample> children[4];
+  for (const LimitSample& sample : samples) {
+    const glm::vec3& b = sample.b;
+    int corner = b.x >= 1.0f ? 0 : b.y >= 1.0f ? 1 : b.z >= 1.0f ? 2 : -1;
+    if (corner >= 0) {
+      positions[sample.index] = cornerPosition[corner];
+      normals[sample.index] = cornerNormal[corner];
+    } else if (depth == maxLimitDepth) {
+      positions[sample.index] = b.x * cornerPosition[0] + b.y * cornerPosition[1] + b.z * cornerPosition[2];
+      normals[sample.index] = unit(b.x * cornerNormal[0] + b.y * cornerNormal[1] + b.z * cornerNormal[2]);
+    } else {
+      // corner child s holds corner s and the edge points of sides s and
+      // s - 1, the middle child the three edge points
+      int s = b.x >= 0.5f ? 0 : b.y >= 0.5f ? 1 : b.z >= 0.5f ? 2 : 3;
+      glm::vec3 child;
+      for (int k = 0; k < 3; k++) {
+        child[k] = s == 3 ? 1.0f - 2.0f * b[(k + 2) % 3] : k == s ? 2.0f * b[k] - 1.0f : 2.0f * b[k];
+      }
+      children[s].push_back(LimitSample{child, sample.index});
+    }
+  }
+  if (children[0].empty() && children[1].empty() && children[2].empty() && children[3].empty()) {
+    return;
+  }
+  Mesh patch;
+  extract_patch(mesh, f, patch);
+  patch.loop_subdivision();
+  for (int s = 0; s < 4; s++) {
+    if (!children[s].empty()) {
+      limit_samples<uint32_t>(patch, 1 + s, children[s], depth + 1, positions, normals);
+    }
+  }
+}
+
+}
+
+template <class Index>
+void BasicMesh<Index>::limit_vertices(std::vector<glm::vec3>& positions, std::vector<glm::vec3>& normals){
+  size_t numVertices = this->positions.size();
+  positions.resize(numVertices);
+  normals.resize(numVertices);
+  if (numVertices == 0) {
+    return;
+  }
+  positions[0] = normals[0] = glm::vec3(0.0f);
+  parallel_for(numVertices - 1, [&](size_t i){
+    vertex_limit(*this, (Index)(i + 1), positions[i + 1], normals[i + 1]);
+  });
+}
+
+template <class Index>
+void BasicMesh<Index>::limit_points(const Index* faces, const glm::vec3* barycentric, size_t count, glm::vec3* positions, glm::vec3* normals){
+  // points of the same face share the refinement, so they are grouped
+  std::vector<std::pair<Index, size_t>> order(count);
+  for (size_t i = 0; i < count; i++) {
+    order[i] = std::make_pair(faces[i], i);
+  }
+  std::sort(order.begin(), order.end());
+  std::vector<size_t> runs;
+  for (size_t i = 0; i < count; i++) {
+    if (i == 0 || order[i].first != order[i - 1].first) {
+      runs.push_back(i);
+    }
+  }
+  runs.push_back(count);
+  parallel_for(runs.size() - 1, [&](size_t r){
+    std::vector<LimitSample> samples;
+    for (size_t i = runs[r]; i < runs[r + 1]; i++) {
+      // clamp and renormalize, so rounding in the caller's weights does not
+      // step outside the face
+      glm::vec3 b = glm::max(barycentric[order[i].second], glm::vec3(0.0f));
+      b /= b.x + b.y + b.z;
+      samples.push_back(LimitSample{b, order[i].second});
+    }
+    limit_samples(*this, order[runs[r]].first, samples, 0, positions, normals);
+  });
+}
+
+#define INSTANTIATE_LOOP_LIMIT(Index) \
+  template void BasicMesh<Index>::limit_vertices(std::vector<glm::vec3>&, std::vector<glm::vec3>&); \
+  template void BasicMesh<Index>::limit_points(const Index*, const glm::vec3*, size_t, glm::vec3*, glm::vec3*);
+
+INSTANTIATE_LOOP_LIMIT(uint16_t)
+INSTANTIATE_LOOP_LIMIT(uint32_t)
+INSTANTIATE_LOOP_LIMIT(uint64_t)
@@ -1,83 +1,179 @@
 #include "mesh.hpp"
+#include "kernels.hpp"
+#include "mesh_io.hpp"
+#include "parallel.hpp"
 #include "viewer.hpp"
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <glm/geometric.hpp>
 #include <iostream>
-#include <sstream>
-#include <fstream>
-#include <unordered_map>
+#include <limits>
+#include <utility>
 
 namespace V = COL781::Viewer;
 
-void Mesh::init(glm::vec3 *vertices, int numVertices, glm::vec3* normals, int numNormals, glm::ivec3 *triangles, int numTriangles){
+template <class Index>
+void BasicMesh<Index>::init(glm::vec3 *vertices, size_t numVertices, glm::vec3* normals, size_t numNormals, glm::ivec3 *triangles, size_t numTriangles){
   freeArrays();
+  if (!fits(numVertices, numTriangles)) {
+    std::cerr << "Mesh: " << numVertices << " vertices and " << numTriangles << " triangles do not fit " << 8 * sizeof(Index) << "-bit indices" << std::endl;
+    return;
+  }
 
-  this->halfEdges = std::vector<HalfEdge>(1 + numTriangles * 3);
-  this->triangles = std::vector<Face>(1 + numTriangles);
-  this->vertices = std::vector<Vertex>(1 + numVertices);
-  std::unordered_map<std::pair<uint32_t, uint32_t>, uint32_t, hash_pair<int,int>> edgeMap;
-
-  // Create the vertices
-  for (int i = 0; i < numVertices; i++) {
-    this->vertices[i + 1].position = vertices[i];
-    if (i < numNormals){
-      this->vertices[i + 1].normal = glm::normalize(normals[i]);
+  this->halfEdges = Buffer<HalfEdge<Index>>(1 + numTriangles * 3);
+  this->positions = Buffer<glm::vec3>(1 + numVertices);
+  this->normals = Buffer<glm::vec3>(1 + numVertices);
+  this->vertexHalfEdges = Buffer<Index>(1 + numVertices);
+
+  // Create the vertices. Zero normals, e.g. of OBJ vertices that no face
+  // gave a normal, are filled in from the faces at the end.
+  std::atomic<bool> missingNormals(false);
+  parallel_for(numVertices, [&](size_t i){
+    this->positions[i + 1] = vertices[i];
+    if (i < numNormals && glm::dot(normals[i], normals[i]) > 0.0f){
+      this->normals[i + 1] = glm::normalize(normals[i]);
     }
     else{
-      this->vertices[i + 1].normal = glm::vec3(0.0f, 0.0f, 0.0f);
+      this->normals[i + 1] = glm::vec3(0.0f, 0.0f, 0.0f);
+      if (numNormals > 0) {
+        missingNormals.store(true, std::memory_order_relaxed);
+      }
     }
-  }
-  // Create the half edges and faces
-  for (uint32_t i = 0; i < numTriangles; i++) {
+  });
+  // Create the half edges, every triangle owns its three slots
+  parallel_for(numTriangles, [&](size_t i){
     // TODO: Orientation of the triangles
-    HalfEdge* edges = &this->halfEdges[i * 3 + 1];
+    HalfEdge<Index>* edges = &this->halfEdges[i * 3 + 1];
     // Set the half edge properties
-    for(uint32_t j=0; j<3; j++){
-      uint32_t index = i * 3 + j + 1;
+    for(Index j=0; j<3; j++){
       edges[j].head = triangles[i][j] + 1;
-      vertex_halfEdge(triangles[i][j] + 1) = index;
-      // Check if the other half of this edge already exists
-      uint32_t v0 = triangles[i][j] + 1;
-      uint32_t v1 = triangles[i][(j + 1) % 3] + 1;
-      uint32_t v0_m = std::min(v0, v1);
-      uint32_t v1_m = std::max(v0, v1);
-      std::pair<uint32_t, uint32_t> p = std::make_pair(v0_m, v1_m);
-      if (edgeMap.find(p) != edgeMap.end()) {
-        edges[j].pair = edgeMap[p];
-        this->halfEdges[edgeMap[p]].pair = index;
-      } else {
-        edgeMap[p] = index;
+    }
+  });
+  pair_halfEdges(numVertices);
+
+  // Every vertex keeps its highest outgoing half-edge, preferring the one
+  // that follows an incoming boundary half-edge, where the ring circulators
+  // start. The max is order independent, so the result does not depend on
+  // the schedule. edge_split and edge_flip keep this choice.
+  std::vector<std::atomic<uint64_t>> best(numVertices + 1);
+  parallel_for(best.size(), [&](size_t v){
+    best[v].store(0, std::memory_order_relaxed);
+  });
+  parallel_for(numTriangles * 3, [&](size_t i){
+    Index he = i + 1;
+    uint64_t rank = ((uint64_t)(edge_pair(edge_prev(he)) == 0) << 63) | he;
+    std::atomic<uint64_t>& slot = best[edge_head(he)];
+    uint64_t current = slot.load(std::memory_order_relaxed);
+    while (current < rank && !slot.compare_exchange_weak(current, rank, std::memory_order_relaxed)) {
+    }
+  });
+  parallel_for(numVertices, [&](size_t i){
+    this->vertexHalfEdges[i + 1] = (Index)(best[i + 1].load(std::memory_order_relaxed) & ~(1ULL << 63));
+  });
+
+  if (missingNormals.load()) {
+    Buffer<glm::vec3> given = this->normals;
+    recompute_normals();
+    parallel_for(numVertices, [&](size_t i){
+      if (glm::dot(given[i + 1], given[i + 1]) > 0.0f) {
+        this->normals[i + 1] = given[i + 1];
       }
-      edges[j].next = i * 3 + (j + 1) % 3 + 1;
-      edges[j].prev = i * 3 + (j + 2) % 3 + 1;
-      edges[j].left = i + 1;
+    });
+  }
+}
+
+// Pairs the half-edges sharing an undirected edge. Edges with more than two
+// half-edges are non-manifold and are left unpaired (as boundaries). Both
+// ends are packed into one sort key while (numVertices + 1)^2 fits 64 bits;
+// larger meshes sort by the higher end and then stably by the lower one.
+template <class Index>
+void BasicMesh<Index>::pair_halfEdges(size_t numVertices){
+  size_t n = this->halfEdges.size() > 0 ? this->halfEdges.size() - 1 : 0;
+  if (n == 0) {
+    return;
+  }
+  auto ends = [&](Index he){
+    Index v0 = edge_head(he);
+    Index v1 = edge_head(edge_next(he));
+    return std::make_pair(std::min(v0, v1), std::max(v0, v1));
+  };
+  auto key_bits = [](uint64_t maxKey){
+    int bits = 0;
+    while (bits < 64 && (maxKey >> bits) != 0) {
+      bits++;
     }
-    // Set the face properties
-    face_halfEdge(i + 1) = i * 3 + 1;
+    return bits;
+  };
+  const uint64_t keyBase = (uint64_t)numVertices + 1;
+  const bool packed = keyBase <= (1ULL << 32);
+  std::vector<EdgeKey<Index>> edgeKeys(n);
+  parallel_for(n, [&](size_t i){
+    std::pair<Index, Index> e = ends(i + 1);
+    edgeKeys[i].key = packed ? (uint64_t)e.first * keyBase + e.second : (uint64_t)e.second;
+    edgeKeys[i].halfEdge = i + 1;
+  });
+  std::vector<EdgeKey<Index>> scratch;
+  auto key = [](const EdgeKey<Index>& e){ return e.key; };
+  radix_sort(edgeKeys, scratch, key_bits(packed ? (keyBase - 1) * keyBase + keyBase - 1 : keyBase), key);
+  if (!packed) {
+    parallel_for(n, [&](size_t i){
+      edgeKeys[i].key = ends(edgeKeys[i].halfEdge).first;
+    });
+    radix_sort(edgeKeys, scratch, key_bits(keyBase), key);
+  }
+  std::vector<EdgeKey<Index>>().swap(scratch);
+  auto same = [&](size_t i, size_t j){
+    return edgeKeys[i].key == edgeKeys[j].key && (packed || ends(edgeKeys[i].halfEdge).second == ends(edgeKeys[j].halfEdge).second);
+  };
+
+  // linear sweep over runs of equal keys, a run belongs to the block it starts in
+  size_t blocks = std::max<size_t>(1, std::min<size_t>(num_threads(), n / 65536));
+  std::vector<Index> nonManifold(blocks, 0);
+  parallel_for(blocks, [&](size_t b){
+    size_t i = n * b / blocks;
+    size_t stop = n * (b + 1) / blocks;
+    while (i > 0 && i < stop && same(i, i - 1)) {
+      i++;
+    }
+    while (i < stop) {
+      size_t j = i + 1;
+      while (j < n && same(j, i)) {
+        j++;
+      }
+      if (j - i == 2) {
+        this->halfEdges[edgeKeys[i].halfEdge].pair = edgeKeys[i + 1].halfEdge;
+        this->halfEdges[edgeKeys[i + 1].halfEdge].pair = edgeKeys[i].halfEdge;
+      } else if (j - i > 2) {
+        nonManifold[b]++;
+      }
+      i = j;
+    }
+  });
+  Index total = 0;
+  for (Index c : nonManifold) {
+    total += c;
+  }
+  if (total > 0) {
+    std::cerr << "Mesh: " << total << " non-manifold edges left unpaired" << std::endl;
   }
 }
 
-Mesh::Mesh(glm::vec3 *vertices, int numVertices, glm::vec3* normals, int numNormals, glm::ivec3 *triangles, int numTriangles)
+template <class Index>
+BasicMesh<Index>::BasicMesh(glm::vec3 *vertices, size_t numVertices, glm::vec3* normals, size_t numNormals, glm::ivec3 *triangles, size_t numTriangles)
 {
   init(vertices, numVertices, normals, numNormals, triangles, numTriangles);
 }
 
-void Mesh::view(){
-  uint32_t numVertices = this->vertices.size();
-  uint32_t numTriangles = this->triangles.size();
-  glm::vec3* vertices = new glm::vec3[numVertices - 1];
-  glm::vec3* normals = new glm::vec3[numVertices - 1];
+template <class Index>
+void BasicMesh<Index>::view(){
+  Index numVertices = this->positions.size();
+  Index numTriangles = num_faces() + 1;
   glm::ivec3* triangles = new glm::ivec3[numTriangles - 1];
 
-  // Copy the vertices and normals
-  for (size_t i = 1; i < numVertices; i++) {
-    vertices[i - 1] = this->vertices[i].position;
-    normals[i - 1] = this->vertices[i].normal;
-  }
-  // Copy the triangles
+  // Copy the triangles, positions and normals are passed as they are stored
   for (size_t i = 1; i < numTriangles; i++) {
-    uint32_t he = face_halfEdge(i);
+    Index he = face_halfEdge(i);
     triangles[i - 1] = glm::ivec3(edge_head(he), edge_head(edge_next(he)), edge_head(edge_prev(he))) - 1;
   }
 
@@ -85,100 +181,312 @@ void Mesh::view(){
 	if (!v.initialize("Mesh viewer", 640, 480)) {
 		return;
 	}
-	v.setVertices(numVertices - 1, vertices);
-	v.setNormals(numVertices - 1, normals);
+	v.setVertices(numVertices - 1, this->positions.data() + 1);
+	v.setNormals(numVertices - 1, this->normals.data() + 1);
 	v.setTriangles(numTriangles - 1, triangles);
 	v.view();
   // local arrays
-  delete [] vertices;
-  delete [] normals;
   delete [] triangles;
 }
 
-void Mesh::print(){
+template <class Index>
+void BasicMesh<Index>::print(){
   // print the Mesh
   std::cout << "Mesh: " << std::endl;
   std::cout << "Vertices: " << std::endl;
   // print the vertices
-  for (size_t i = 1; i < this->vertices.size(); i++) {
-    Vertex& v = this->vertices[i];
-    std::cout << "  " << v.position.x << " " << v.position.y << " " << v.position.z << std::endl;
+  for (size_t i = 1; i < this->positions.size(); i++) {
+    glm::vec3& p = this->positions[i];
+    std::cout << "  " << p.x << " " << p.y << " " << p.z << std::endl;
   }
   std::cout << "Triangles: " << std::endl;
-  for (size_t i = 1; i < this->triangles.size(); i++) {
-    uint32_t he = face_halfEdge(i);
+  for (size_t i = 1; i <= num_faces(); i++) {
+    Index he = face_halfEdge(i);
     std::cout << " " << edge_head(he) - 1;
     std::cout << " " << edge_head(edge_next(he)) - 1;
     std::cout << " " << edge_head(edge_prev(he)) - 1 << std::endl;
   }
   std::cout << "normals: " << std::endl;
-  for (size_t i = 1; i < this->vertices.size(); i++) {
-    Vertex& v = this->vertices[i];
-    std::cout << "  " << v.normal.x << " " << v.normal.y << " " << v.normal.z << std::endl;
-  }
-}
-
-Mesh::Mesh(std::string filename){
-  std::ifstream f(filename);
-  std::string line;
-  std::vector<glm::vec3> vertices, normals;
-  std::vector<glm::ivec3> triangles;
-  while(getline(f,line)){
-    std::istringstream s(line);
-    std::string head;
-    s >> head;
-    if(head == "vn"){
-      glm::vec3 normal;
-      s >> normal.x >> normal.y >> normal.z;
-      normals.push_back(normal);
-    }
-    if(head == "v"){
-      glm::vec3 vertex;
-      s >> vertex.x >> vertex.y >> vertex.z;
-      vertices.push_back(vertex);
-    }
-    if(head == "f"){
-      std::string temp;
-      glm::ivec3 triangle;
-      for(int i=0; i<3; i++){
-          s >> temp;
-          //TODO: is this correct?
-          std::string last_val(temp.substr(0,temp.find("/"))); 
-          triangle[i] = stoi(last_val);
+  for (size_t i = 1; i < this->normals.size(); i++) {
+    glm::vec3& n = this->normals[i];
+    std::cout << "  " << n.x << " " << n.y << " " << n.z << std::endl;
+  }
+}
+
+template <class Index>
+BasicMesh<Index>::BasicMesh(std::string filename, float weldTolerance){
+  MeshData data;
+  if (!load_mesh_data(filename, data, weldTolerance)) {
+    std::cerr << "Mesh: could not load " << filename << ", the mesh is left empty" << std::endl;
+    return;
+  }
+  init(data.vertices.data(), data.vertices.size(), data.normals.data(), data.normals.size(), data.triangles.data(), data.triangles.size());
+}
+
+namespace {
+
+// The vector kernels gather with signed 32-bit indices
+bool packable(size_t n){
+  return simd_round_up(n) + simdLanes <= (size_t)std::numeric_limits<int32_t>::max();
+}
+
+// Calls f(first, last) for consecutive blocks of [0, n) in parallel
+template <class F>
+void parallel_blocks(size_t n, size_t block, F f){
+  parallel_for((n + block - 1) / block, [&](size_t b){
+    f(b * block, std::min(n, (b + 1) * block));
+  });
+}
+
+// Numbers the indices i < n with keep(i) from 1 in order into map, 0 for
+// the others, and returns how many are kept. Blocks count their survivors,
+// then number them from a prefix sum over the blocks.
+template <class Map, class Keep>
+size_t renumber(size_t n, Keep keep, Map& map){
+  const size_t block = 4096;
+  size_t numBlocks = (n + block - 1) / block;
+  std::vector<size_t> offsets(numBlocks + 1, 0);
+  parallel_blocks(n, block, [&](size_t first, size_t last){
+    size_t count = 0;
+    for (size_t i = first; i < last; i++) {
+      count += keep(i);
+    }
+    offsets[first / block + 1] = count;
+  });
+  for (size_t b = 0; b < numBlocks; b++) {
+    offsets[b + 1] += offsets[b];
+  }
+  parallel_blocks(n, block, [&](size_t first, size_t last){
+    size_t next = offsets[first / block];
+    for (size_t i = first; i < last; i++) {
+      map[i] = keep(i) ? ++next : 0;
+    }
+  });
+  return offsets[numBlocks];
+}
+
+// Componentwise dot products of two vec3 arrays, summed in double over
+// fixed blocks so the result does not depend on the number of threads
+glm::dvec3 dot3(const glm::vec3* a, const glm::vec3* b, size_t n){
+  const size_t block = 4096;
+  std::vector<glm::dvec3> partial((n + block - 1) / block);
+  parallel_blocks(n, block, [&](size_t first, size_t last){
+    glm::dvec3 sum(0.0);
+    for (size_t i = first; i < last; i++) {
+      sum += glm::dvec3(a[i]) * glm::dvec3(b[i]);
+    }
+    partial[first / block] = sum;
+  });
+  glm::dvec3 total(0.0);
+  for (const glm::dvec3& sum : partial) {
+    total += sum;
+  }
+  return total;
+}
+
+}
+
+// Normals of the given faces, or of faces 1..count when faces is null,
+// into faceNormals
+template <class Index>
+void BasicMesh<Index>::compute_face_normals(const Index* faces, size_t count){
+  const glm::vec3* positions = this->positions.data();
+  if (!packable(3 * this->positions.size())) {
+    parallel_for(count, [&](size_t i){
+      Index f = faces ? faces[i] : i + 1;
+      Index he = face_halfEdge(f);
+      glm::vec3 e1 = positions[edge_head(edge_next(he))] - positions[edge_head(he)];
+      glm::vec3 e2 = positions[edge_head(edge_prev(he))] - positions[edge_head(he)];
+      float weight = 1 / glm::length(e1) / glm::length(e2);
+      this->faceNormals[f] = glm::cross(e1, e2) * weight * weight;
+    });
+    return;
+  }
+  // vector lanes, a block of faces at a time so the corners and face
+  // normals stay in the L1 cache
+  const size_t block = 256;
+  parallel_blocks(count, block, [&](size_t first, size_t last){
+    alignas(32) uint32_t a[block], b[block], c[block];
+    alignas(32) float nx[block], ny[block], nz[block];
+    size_t n = last - first;
+    for (size_t i = 0; i < n; i++) {
+      Index he = face_halfEdge(faces ? faces[first + i] : first + i + 1);
+      a[i] = edge_head(he);
+      b[i] = edge_head(edge_next(he));
+      c[i] = edge_head(edge_prev(he));
+    }
+    // lanes past the last face read the dummy vertex and are dropped
+    size_t lanes = simd_round_up(n);
+    std::fill(a + n, a + lanes, 0);
+    std::fill(b + n, b + lanes, 0);
+    std::fill(c + n, c + lanes, 0);
+    face_normals((const float*)positions, a, b, c, nx, ny, nz, lanes);
+    for (size_t i = 0; i < n; i++) {
+      this->faceNormals[faces ? faces[first + i] : first + i + 1] = glm::vec3(nx[i], ny[i], nz[i]);
+    }
+  });
+}
+
+// Sums the face normals around each of the given vertices, or vertices
+// 1..count when vertices is null, in ring order and normalizes them. Full
+// passes read the faces from the adjacency when it is cached; building it
+// just for this costs more than walking the rings.
+template <class Index>
+void BasicMesh<Index>::gather_normals(const Index* vertices, size_t count){
+  if (!vertices && this->adjacencyValid) {
+    // the outgoing half-edges of a vertex, without the boundary tail, are
+    // stored in the order the ring walk visits them
+    const Adjacency<Index>& adj = this->adjacency;
+    parallel_blocks(count, 4096, [&](size_t first, size_t last){
+      for (size_t v = first + 1; v <= last; v++) {
+        glm::vec3 sum(0.0f);
+        for (size_t k = adj.offsets[v]; k < adj.offsets[v + 1] - adj.boundary[v]; k++) {
+          sum += this->faceNormals[edge_left(adj.halfEdges[k])];
+        }
+        this->normals[v] = sum;
+      }
+      normalize_vectors((float*)&this->normals[first + 1], last - first);
+    });
+    return;
+  }
+  parallel_blocks(count, 4096, [&](size_t first, size_t last){
+    for (size_t i = first; i < last; i++) {
+      Index v = vertices ? vertices[i] : i + 1;
+      glm::vec3 sum(0.0f);
+      for (Index f : vertex_faces(v)) {
+        sum += this->faceNormals[f];
       }
-      triangles.push_back(triangle - 1);
+      this->normals[v] = sum;
+    }
+    if (vertices) {
+      for (size_t i = first; i < last; i++) {
+        normalize_vectors((float*)&this->normals[vertices[i]], 1);
+      }
+    } else {
+      normalize_vectors((float*)&this->normals[first + 1], last - first);
+    }
+  });
+}
+
+template <class Index>
+void BasicMesh<Index>::recompute_normals(){
+  size_t numVertices = this->normals.size();
+  if (numVertices == 0) {
+    return;
+  }
+  this->faceNormals.resize(num_faces() + 1);
+  compute_face_normals(nullptr, num_faces());
+  this->normals[0] = glm::vec3(0.0f);
+  gather_normals(nullptr, numVertices - 1);
+  this->movedVertices.clear();
+  this->changedFaces.clear();
+  this->normalsValid = true;
+}
+
+template <class Index>
+void BasicMesh<Index>::update_normals(){
+  if (!this->normalsValid) {
+    recompute_normals();
+    return;
+  }
+  // faces added since the last call
+  size_t numFaces = num_faces();
+  for (size_t f = this->faceNormals.size(); f <= numFaces; f++) {
+    this->changedFaces.push_back(f);
+  }
+  this->faceNormals.resize(numFaces + 1);
+  for (Index v : this->movedVertices) {
+    for (Index f : vertex_faces(v)) {
+      this->changedFaces.push_back(f);
+    }
+  }
+  std::vector<Index>& faces = this->changedFaces;
+  std::sort(faces.begin(), faces.end());
+  faces.erase(std::unique(faces.begin(), faces.end()), faces.end());
+  compute_face_normals(faces.data(), faces.size());
+  // every corner of a changed face has a changed normal
+  std::vector<Index> vertices;
+  vertices.reserve(3 * faces.size());
+  for (Index f : faces) {
+    for (Index v : face_vertices(f)) {
+      vertices.push_back(v);
+    }
+  }
+  std::sort(vertices.begin(), vertices.end());
+  vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+  gather_normals(vertices.data(), vertices.size());
+  this->movedVertices.clear();
+  this->changedFaces.clear();
+}
+
+template <class Index>
+void BasicMesh<Index>::touch_vertex(Index v){
+  if (this->normalsValid) {
+    this->movedVertices.push_back(v);
+    // past a few percent of the mesh a full pass is cheaper
+    if (this->movedVertices.size() > this->positions.size() / 16 + 64) {
+      this->normalsValid = false;
     }
   }
-  init(&vertices[0], vertices.size(), &normals[0], normals.size(), &triangles[0], triangles.size());
 }
 
-void Mesh::recompute_normals(){
-  // reset normals
-  for (size_t i = 1; i < this->vertices.size(); i++) {
-    this->vertices[i].normal = glm::vec3(0.0f, 0.0f, 0.0f);
+template <class Index>
+void BasicMesh<Index>::touch_face(Index f){
+  if (this->normalsValid) {
+    this->changedFaces.push_back(f);
+    if (this->changedFaces.size() > (size_t)num_faces() / 16 + 64) {
+      this->normalsValid = false;
+    }
   }
-  // weighted sum of face normals
-  for (size_t i = 1; i < this->triangles.size(); i++) {
-    uint32_t he = face_halfEdge(i);
-    glm::vec3 e1 = this->vertices[edge_head(edge_next(he))].position - this->vertices[edge_head(he)].position;
-    glm::vec3 e2 = this->vertices[edge_head(edge_prev(he))].position - this->vertices[edge_head(he)].position;
-    glm::vec3 normal = glm::cross(e1, e2);
-//    normal = glm::normalize(normal);
-    float weight = 1 / glm::length(e1) / glm::length(e2);
-    normal = normal * weight * weight;
-    this->vertices[edge_head(he)].normal += normal;
-    this->vertices[edge_head(edge_next(he))].normal += normal;
-    this->vertices[edge_head(edge_prev(he))].normal += normal;
+}
+
+template <class Index>
+void BasicMesh<Index>::smoothing(int iter, float lambda, float mu){
+  size_t numVertices = this->positions.size();
+  if (numVertices == 0) {
+    return;
   }
-  // normalize
-  for (Vertex& v : this->vertices) {
-    v.normal = glm::normalize(v.normal);
+  this->normalsValid = false;
+  if (!packable(numVertices)) {
+    smoothing_scalar(iter, lambda, mu);
+    return;
   }
+  // the topology is fixed, so every iteration streams the same adjacency,
+  // padded per slice of vertices for the vector kernels. The far ends of
+  // the outgoing half-edges are averaged, which leaves out the last
+  // neighbour of a boundary vertex.
+  const Adjacency<Index>& adj = vertex_adjacency();
+  PackedVec3 current, next;
+  current.pack(this->positions.data(), numVertices);
+  next.resize(numVertices);
+  PaddedAdjacency padded;
+  pad_adjacency(adj.offsets.data(), adj.neighbours.data(), adj.boundary.data(), numVertices, current.zero, padded);
+  // Jacobi iteration: every stage reads one position buffer and writes the
+  // other, one vertex per index, so the result does not depend on how the
+  // vertex range is split between threads
+  for(int i=0; i<iter; i++){
+    for(int stage=0; stage<2; stage++){
+      // for Taubin smoothing
+      float lambda_applied = lambda;
+      if(stage%2==1){
+        lambda_applied = mu;
+      }
+      parallel_blocks(padded.num_slices(), 64, [&](size_t first, size_t last){
+        smooth_step(padded, current, next, lambda_applied, first, last);
+      });
+      std::swap(current, next);
+    }
+  }
+  current.unpack(this->positions.data(), numVertices);
 }
 
-void Mesh::smoothing(int iter, float lambda, float mu){
-  int numVertices = this->vertices.size();
-  glm::vec3* delta = new glm::vec3[numVertices];
+// Same as smoothing, for meshes too large for 32-bit gather indices
+template <class Index>
+void BasicMesh<Index>::smoothing_scalar(int iter, float lambda, float mu){
+  size_t numVertices = this->positions.size();
+  this->normalsValid = false;
+  Buffer<glm::vec3> next(numVertices);
+  const Adjacency<Index>& adj = vertex_adjacency();
   for(int i=0; i<iter; i++){
     for(int stage=0; stage<2; stage++){
       // for Taubin smoothing
@@ -186,437 +494,963 @@ void Mesh::smoothing(int iter, float lambda, float mu){
       if(stage%2==1){
         lambda_applied = mu;
       }
-      // reset delta
-      std::fill_n(delta, numVertices, glm::vec3(0));
-      // compute delta                                        
-      for (size_t j = 1; j < numVertices; j++) {        
-        uint32_t startEdge = vertex_halfEdge(j);
-        uint32_t e = startEdge;
-        {
-          uint32_t temp = e;
-          // anti-clockwise
-          do{
-            e = temp;
-            temp = edge_pair(edge_prev(e));
-            if(temp == startEdge){
-              e = temp;
-              break;
-            }
-          }while(temp!=0);
+      const glm::vec3* positions = this->positions.data();
+      glm::vec3* out = next.data();
+      out[0] = positions[0];
+      parallel_for(numVertices - 1, [&](size_t v){
+        size_t j = v + 1;
+        size_t begin = adj.offsets[j];
+        size_t end = adj.offsets[j + 1] - adj.boundary[j];
+        if (begin == end) {
+          // isolated vertex
+          out[j] = positions[j];
+          return;
         }
-        int neighbors = 0;                                    
-        // finding all the neighbours, clockwise
-        do{
-            neighbors++;                        
-            delta[j] += this->vertices[edge_head(edge_next(e))].position;
-            e = edge_pair(e);
-            if(e==0){
-              break;
-            }
-            e = edge_next(e);
+        glm::vec3 delta(0.0f);
+        for (size_t k = begin; k < end; k++) {
+          delta += positions[adj.neighbours[k]];
         }
-        while(e!=startEdge);
-        // average                                            
-        delta[j] /= (float) neighbors;                        
-        delta[j] -= this->vertices[j].position;               
-      }                                                       
-      // update vertices at the end of each iteration         
-      for (size_t j = 1; j < numVertices; j++) {        
-        this->vertices[j].position += lambda_applied * delta[j];      
-      }                                                       
-    }   
+        // average
+        delta /= (float)(end - begin);
+        delta -= positions[j];
+        out[j] = positions[j] + lambda_applied * delta;
+      });
+      std::swap(this->positions, next);
+    }
   }
-  delete [] delta;
 }
 
-uint32_t& Mesh::vertex_halfEdge(uint32_t i){
-  assert(i < this->vertices.size() && i > 0);
-  return this->vertices[i].halfEdge;
+template <class Index>
+bool BasicMesh<Index>::implicit_smoothing(float lambda, bool cotan, int maxIterations, float tolerance){
+  size_t numVertices = this->positions.size();
+  if (numVertices == 0) {
+    return true;
+  }
+  this->normalsValid = false;
+  // the whole ring, including the last neighbour of a boundary vertex, so
+  // the matrix is symmetric
+  const Adjacency<Index>& adj = vertex_adjacency(cotan);
+  auto weight = [&](size_t k){
+    return cotan ? adj.cotanWeights[k] : 1.0f;
+  };
+  // diagonals of L and M
+  Buffer<float> laplacian(numVertices);
+  Buffer<float> mass(numVertices);
+  parallel_for(numVertices, [&](size_t v){
+    float sum = 0.0f;
+    float area = 0.0f;
+    for (size_t k = adj.offsets[v]; k < adj.offsets[v + 1]; k++) {
+      sum += weight(k);
+      if (cotan && k < adj.offsets[v + 1] - adj.boundary[v]) {
+        // a third of the face left of each outgoing half-edge
+        Index he = adj.halfEdges[k];
+        glm::vec3 a = this->positions[edge_head(he)];
+        glm::vec3 e1 = this->positions[edge_head(edge_next(he))] - a;
+        glm::vec3 e2 = this->positions[edge_head(edge_prev(he))] - a;
+        area += glm::length(glm::cross(e1, e2)) / 6.0f;
+      }
+    }
+    laplacian[v] = sum;
+    mass[v] = cotan ? area : (float)(adj.offsets[v + 1] - adj.offsets[v]);
+  });
+  // scale the areas to the mean of the Laplacian diagonal; isolated and
+  // degenerate vertices get the mean mass, so they keep their position
+  double massSum = 0.0;
+  double laplacianSum = 0.0;
+  size_t counted = 0;
+  for (size_t v = 1; v < numVertices; v++) {
+    if (mass[v] > 0.0f) {
+      massSum += mass[v];
+      laplacianSum += laplacian[v];
+      counted++;
+    }
+  }
+  float scale = cotan && massSum > 0.0 ? (float)(laplacianSum / massSum) : 1.0f;
+  float meanMass = counted > 0 ? (float)(massSum / counted) * scale : 1.0f;
+  Buffer<float> inverseDiagonal(numVertices);
+  parallel_for(numVertices, [&](size_t v){
+    mass[v] = mass[v] > 0.0f ? mass[v] * scale : meanMass;
+    inverseDiagonal[v] = 1.0f / (mass[v] + lambda * laplacian[v]);
+  });
+  // y = (M + lambda L) x
+  auto multiply = [&](const Buffer<glm::vec3>& x, Buffer<glm::vec3>& y){
+    parallel_for(numVertices, [&](size_t v){
+      glm::vec3 sum(0.0f);
+      for (size_t k = adj.offsets[v]; k < adj.offsets[v + 1]; k++) {
+        sum += weight(k) * x[adj.neighbours[k]];
+      }
+      y[v] = (mass[v] + lambda * laplacian[v]) * x[v] - lambda * sum;
+    });
+  };
+
+  // conjugate gradients on the three coordinates at once, each with its
+  // own step sizes, starting from the current positions
+  Buffer<glm::vec3>& x = this->positions;
+  Buffer<glm::vec3> r(numVertices), z(numVertices), p(numVertices), q(numVertices);
+  multiply(x, q);
+  parallel_for(numVertices, [&](size_t v){
+    glm::vec3 b = mass[v] * x[v];
+    r[v] = b - q[v];
+    // b, kept in p for its norm
+    p[v] = b;
+  });
+  glm::dvec3 threshold = dot3(p.data(), p.data(), numVertices) * ((double)tolerance * tolerance);
+  parallel_for(numVertices, [&](size_t v){
+    z[v] = inverseDiagonal[v] * r[v];
+    p[v] = z[v];
+  });
+  glm::dvec3 rz = dot3(r.data(), z.data(), numVertices);
+  glm::dvec3 rr = dot3(r.data(), r.data(), numVertices);
+  int iteration = 0;
+  for (; iteration < maxIterations; iteration++) {
+    if (rr.x <= threshold.x && rr.y <= threshold.y && rr.z <= threshold.z) {
+      break;
+    }
+    multiply(p, q);
+    glm::dvec3 pq = dot3(p.data(), q.data(), numVertices);
+    // converged coordinates stop moving
+    glm::vec3 alpha(0.0f);
+    for (int c = 0; c < 3; c++) {
+      if (rr[c] > threshold[c] && pq[c] > 0.0) {
+        alpha[c] = (float)(rz[c] / pq[c]);
+      }
+    }
+    parallel_for(numVertices, [&](size_t v){
+      x[v] += alpha * p[v];
+      r[v] -= alpha * q[v];
+      z[v] = inverseDiagonal[v] * r[v];
+    });
+    glm::dvec3 rzNext = dot3(r.data(), z.data(), numVertices);
+    rr = dot3(r.data(), r.data(), numVertices);
+    glm::vec3 beta(0.0f);
+    for (int c = 0; c < 3; c++) {
+      if (rz[c] > 0.0) {
+        beta[c] = (float)(rzNext[c] / rz[c]);
+      }
+    }
+    rz = rzNext;
+    parallel_for(numVertices, [&](size_t v){
+      p[v] = z[v] + beta * p[v];
+    });
+  }
+  if (rr.x > threshold.x || rr.y > threshold.y || rr.z > threshold.z) {
+    std::cerr << "Mesh: implicit smoothing did not converge in " << maxIterations << " iterations" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+template <class Index>
+const Adjacency<Index>& BasicMesh<Index>::vertex_adjacency(bool cotanWeights){
+  if (!this->adjacencyValid) {
+    build_adjacency();
+    this->adjacencyValid = true;
+  }
+  if (cotanWeights) {
+    update_cotan_weights();
+  }
+  return this->adjacency;
 }
 
-uint32_t& Mesh::edge_head(uint32_t i){
-  assert(i < this->halfEdges.size() && i > 0);
-  return this->halfEdges[i].head;
+template <class Index>
+void BasicMesh<Index>::build_adjacency(){
+  Adjacency<Index>& adj = this->adjacency;
+  size_t numVertices = this->positions.size();
+  adj.offsets.resize(numVertices + 1);
+  adj.boundary.resize(numVertices);
+  adj.cotanWeights.clear();
+  if (numVertices == 0) {
+    adj.offsets[0] = 0;
+    adj.neighbours.clear();
+    adj.halfEdges.clear();
+    return;
+  }
+  // ring sizes, then a prefix sum into the offsets
+  adj.offsets[0] = 0;
+  adj.offsets[1] = 0;
+  adj.boundary[0] = 0;
+  parallel_for(numVertices - 1, [&](size_t i){
+    Index v = i + 1;
+    size_t count = 0;
+    for (Index he : vertex_outgoing(v)) {
+      (void)he;
+      count++;
+    }
+    Index start = this->vertexHalfEdges[v];
+    adj.boundary[v] = start != 0 && edge_pair(edge_prev(start)) == 0;
+    adj.offsets[v + 1] = count + adj.boundary[v];
+  });
+  for (size_t v = 1; v <= numVertices; v++) {
+    adj.offsets[v] += adj.offsets[v - 1];
+  }
+  adj.neighbours.resize(adj.offsets[numVertices]);
+  adj.halfEdges.resize(adj.offsets[numVertices]);
+  parallel_for(numVertices - 1, [&](size_t i){
+    Index v = i + 1;
+    size_t k = adj.offsets[v];
+    for (Index he : vertex_outgoing(v)) {
+      adj.neighbours[k] = edge_head(edge_next(he));
+      adj.halfEdges[k] = he;
+      k++;
+    }
+    if (adj.boundary[v]) {
+      Index incoming = edge_prev(this->vertexHalfEdges[v]);
+      adj.neighbours[k] = edge_head(incoming);
+      adj.halfEdges[k] = incoming;
+    }
+  });
 }
 
-uint32_t& Mesh::edge_next(uint32_t i){
-  assert(i < this->halfEdges.size() && i > 0);
-  return this->halfEdges[i].next;
+namespace {
+
+// Cotangent of the angle at the corner opposite half-edge he
+template <class Index>
+float opposite_cotan(BasicMesh<Index>& mesh, const glm::vec3* positions, Index he){
+  const glm::vec3& a = positions[mesh.edge_head(he)];
+  const glm::vec3& b = positions[mesh.edge_head(mesh.edge_next(he))];
+  const glm::vec3& o = positions[mesh.edge_head(mesh.edge_prev(he))];
+  glm::vec3 u = a - o;
+  glm::vec3 w = b - o;
+  float area = glm::length(glm::cross(u, w));
+  return area > 0.0f ? glm::dot(u, w) / area : 0.0f;
 }
 
-uint32_t& Mesh::edge_prev(uint32_t i){
-  assert(i < this->halfEdges.size() && i > 0);
-  return this->halfEdges[i].prev;
 }
 
-uint32_t& Mesh::edge_pair(uint32_t i){
-  assert(i < this->halfEdges.size() && i > 0);
-  return this->halfEdges[i].pair;
+template <class Index>
+void BasicMesh<Index>::update_cotan_weights(){
+  Adjacency<Index>& adj = this->adjacency;
+  adj.cotanWeights.resize(adj.neighbours.size());
+  const glm::vec3* positions = this->positions.data();
+  parallel_for(adj.halfEdges.size(), [&](size_t k){
+    Index he = adj.halfEdges[k];
+    Index pair = edge_pair(he);
+    float weight = opposite_cotan(*this, positions, he);
+    if (pair != 0) {
+      weight += opposite_cotan(*this, positions, pair);
+    }
+    adj.cotanWeights[k] = 0.5f * weight;
+  });
 }
 
-uint32_t& Mesh::edge_left(uint32_t he){
-  assert(he < this->halfEdges.size() && he > 0);
-  return this->halfEdges[he].left;
+template <class Index>
+void BasicMesh<Index>::freeArrays(){
+  invalidate_adjacency();
+  this->normalsValid = false;
+  this->faceNormals.clear();
+  this->movedVertices.clear();
+  this->changedFaces.clear();
+  this->positions.clear();
+  this->normals.clear();
+  this->vertexHalfEdges.clear();
+  this->halfEdges.clear();
+  this->freeVertices.clear();
+  this->freeFaces.clear();
 }
 
-uint32_t& Mesh::face_halfEdge(uint32_t i){
-  assert(i < this->triangles.size() && i > 0);
-  return this->triangles[i].halfEdge;
+template <class Index>
+Index BasicMesh<Index>::push_vertex(){
+  invalidate_adjacency();
+  if (!this->freeVertices.empty()) {
+    Index v = this->freeVertices.back();
+    this->freeVertices.pop_back();
+    this->positions[v] = glm::vec3();
+    this->normals[v] = glm::vec3();
+    this->vertexHalfEdges[v] = 0;
+    return v;
+  }
+  this->positions.push_back(glm::vec3());
+  this->normals.push_back(glm::vec3());
+  this->vertexHalfEdges.push_back(0);
+  return this->positions.size() - 1;
 }
 
-void Mesh::freeArrays(){
-  this->vertices.clear();
-  this->triangles.clear();
-  this->halfEdges.clear();
+// A reused face slot already holds three cleared half-edges
+template <class Index>
+Index BasicMesh<Index>::push_triangle(){
+  invalidate_adjacency();
+  if (!this->freeFaces.empty()) {
+    Index f = this->freeFaces.back();
+    this->freeFaces.pop_back();
+    return f;
+  }
+  if (this->halfEdges.empty()) {
+    this->halfEdges.push_back(HalfEdge<Index>());
+  }
+  this->halfEdges.resize(this->halfEdges.size() + 3);
+  return num_faces();
+}
+
+// Sets the corners of face f in order, the pairs are left untouched
+template <class Index>
+void BasicMesh<Index>::set_face(Index f, Index v0, Index v1, Index v2){
+  touch_face(f);
+  Index he = face_halfEdge(f);
+  this->halfEdges[he].head = v0;
+  this->halfEdges[he + 1].head = v1;
+  this->halfEdges[he + 2].head = v2;
 }
 
-uint32_t Mesh::push_vertex(){
-  this->vertices.push_back(Vertex());
-  return this->vertices.size() - 1;
+// Makes a and b each other's pair, b == 0 marks a as boundary
+template <class Index>
+void BasicMesh<Index>::link_halfEdges(Index a, Index b){
+  edge_pair(a) = b;
+  if (b != 0) {
+    edge_pair(b) = a;
+  }
 }
 
-uint32_t Mesh::push_triangle(){
-  this->triangles.push_back(Face());
-  return this->triangles.size() - 1;
+// Returns the half-edge going from one vertex to another, 0 if there is none
+template <class Index>
+Index BasicMesh<Index>::find_halfEdge(Index from, Index to){
+  for (Index he : vertex_outgoing(from)) {
+    if (edge_head(edge_next(he)) == to) {
+      return he;
+    }
+  }
+  return 0;
+}
+
+// Rewinds anti-clockwise from an outgoing half-edge to the one following
+// the boundary, which is where the vertex's ring walks start. Interior
+// vertices keep he.
+template <class Index>
+Index BasicMesh<Index>::ring_start(Index he){
+  Index e = he;
+  while (true) {
+    Index temp = edge_pair(edge_prev(e));
+    if (temp == 0) {
+      return e;
+    }
+    if (temp == he) {
+      return he;
+    }
+    e = temp;
+  }
 }
 
-uint32_t Mesh::push_halfEdge(){
-  this->halfEdges.push_back(HalfEdge());
-  return this->halfEdges.size() - 1;
+// Both splits and flips rewrite the faces they touch slot by slot, so every
+// face keeps its three half-edges at 3f-2..3f. Half-edges of an untouched
+// edge may move to another slot, their outside pair is relinked.
+template <class Index>
+void BasicMesh<Index>::edge_split(Index he){
+  invalidate_adjacency();
+  Index v = push_vertex();
+  Index fa = push_triangle();
+  Index fb = edge_pair(he) ? push_triangle() : 0;
+  split_edge(he, v, fa, fb);
 }
 
-void Mesh::edge_split(uint32_t he){
+// Splits he into the new vertex v and faces fa and, for an interior edge,
+// fb, which must already be allocated. Writes nothing outside the faces
+// and vertices of the edge, so splits of edges whose one-rings do not
+// overlap can run in parallel.
+template <class Index>
+void BasicMesh<Index>::split_edge(Index he, Index v, Index fa, Index fb){
   if (edge_pair(he) == 0) {
     // boundary edge
-    uint32_t f0 = edge_left(he);
+    Index f0 = edge_left(he);
 
-    uint32_t v0 = edge_head(he);
-    uint32_t v1 = edge_head(edge_next(he));
-    uint32_t v2 = edge_head(edge_prev(he));
+    Index v0 = edge_head(he);
+    Index v1 = edge_head(edge_next(he));
+    Index v2 = edge_head(edge_prev(he));
     
-    uint32_t e0 = he;
-    uint32_t e1 = edge_next(he);
-    uint32_t e2 = edge_prev(he);
+    Index p1 = edge_pair(edge_next(he));
+    Index p2 = edge_pair(edge_prev(he));
     
     //             v1
     //            --|
-    //       e1 --  |
-    //        --    | e3
-    //      --   e5 |
+    //       p1 --  |
+    //        --    | f1
+    //      --      |
     // v2 ----------| v3
-    //      --   e4 |
-    //        --    | e0
-    //       e2 --  |
+    //      --      |
+    //        --    | f0
+    //       p2 --  |
     //            --|
     //             v0
     
-    // create new structures
-    uint32_t v3 = push_vertex();
-    this->vertices[v3].position = (this->vertices[v0].position + this->vertices[v1].position) / 2.0f;
-
-    uint32_t e3 = push_halfEdge();
-    uint32_t e4 = push_halfEdge();
-    uint32_t e5 = push_halfEdge();
-
-    std::cout << "e5: " << e5 << std::endl;
-
-    uint32_t f1 = push_triangle();
-
-    // update old structures
-    edge_next(e0) = e4;
-    edge_prev(e0) = e2;
-    edge_head(e0) = v0;
-    edge_left(e0) = f0;
-
-    edge_next(e1) = e5;
-    edge_prev(e1) = e3;
-    edge_head(e1) = v1;
-    edge_left(e1) = f1;
-
-    edge_next(e2) = e0;
-    edge_prev(e2) = e4;
-    edge_head(e2) = v2;
-    edge_left(e2) = f0;
-
-    face_halfEdge(f1) = e3;
-    
-    // update new structures
-    edge_next(e3) = e1;
-    edge_prev(e3) = e5;
-    edge_head(e3) = v3;
-    edge_pair(e3) = 0;
-    edge_left(e3) = f1;
-
-    edge_next(e4) = e2;
-    edge_prev(e4) = e0;
-    edge_head(e4) = v3;
-    edge_pair(e4) = e5;
-    edge_left(e4) = f0;
-
-    edge_next(e5) = e3;
-    edge_prev(e5) = e1;
-    edge_head(e5) = v2;
-    edge_pair(e5) = e4;
-    edge_left(e5) = f1;
-
-    face_halfEdge(f0) = e0;
-
-    vertex_halfEdge(v0) = e0;
-    vertex_halfEdge(v1) = e1;
-    vertex_halfEdge(v2) = e2;
-    vertex_halfEdge(v3) = e3;
+    Index v3 = v;
+    this->positions[v3] = (this->positions[v0] + this->positions[v1]) / 2.0f;
+
+    Index f1 = fa;
+
+    set_face(f0, v0, v3, v2);
+    set_face(f1, v3, v1, v2);
+    Index a = face_halfEdge(f0);
+    Index b = face_halfEdge(f1);
+
+    link_halfEdges(a, 0);
+    link_halfEdges(a + 1, b + 2);
+    link_halfEdges(a + 2, p2);
+    link_halfEdges(b, 0);
+    link_halfEdges(b + 1, p1);
+
+    vertex_halfEdge(v0) = ring_start(a);
+    vertex_halfEdge(v1) = ring_start(b + 1);
+    vertex_halfEdge(v2) = ring_start(a + 2);
+    vertex_halfEdge(v3) = ring_start(b);
   }
   else{
     // interior edge
-    uint32_t f0 = edge_left(he);
-    uint32_t f1 = edge_left(edge_pair(he));
+    Index f0 = edge_left(he);
+    Index f1 = edge_left(edge_pair(he));
 
-    uint32_t e0 = he;
-    uint32_t e1 = edge_next(he);
-    uint32_t e2 = edge_prev(he);
-    uint32_t e3 = edge_pair(he);
-    uint32_t e4 = edge_next(edge_pair(he));
-    uint32_t e5 = edge_prev(edge_pair(he));
+    Index e3 = edge_pair(he);
 
-    uint32_t v0 = edge_head(he);
-    uint32_t v1 = edge_head(e1);
-    uint32_t v2 = edge_head(e2);
-    uint32_t v3 = edge_head(e5);
+    Index v0 = edge_head(he);
+    Index v1 = edge_head(edge_next(he));
+    Index v2 = edge_head(edge_prev(he));
+    Index v3 = edge_head(edge_prev(e3));
+
+    Index p1 = edge_pair(edge_next(he));
+    Index p2 = edge_pair(edge_prev(he));
+    Index p4 = edge_pair(edge_next(e3));
+    Index p5 = edge_pair(edge_prev(e3));
 
     //                 v1
     //            --|      |--
-    //       e1 --  |      |  -- e5
-    //        --    | e6   | e3  -- 
-    //      --   e8 |      |   e10  --
+    //       p1 --  |      |  -- p5
+    //        --    |      |     -- 
+    //      --   f2 |      |  f1    --
     // v2 ----------|  v4  |----------- v3
-    //      --   e7 |      |   e11  --
-    //        --    | e0   | e9  --
-    //       e2 --  |      |  -- e4
+    //      --   f0 |      |  f3    --
+    //        --    |      |     --
+    //       p2 --  |      |  -- p4
     //            --|      |--
     //                 v0
-    // create new structures
-    uint32_t v4 = push_vertex();
-    this->vertices[v4].position = (3.0f * this->vertices[v0].position + 3.0f * this->vertices[v1].position + this->vertices[v2].position + this->vertices[v3].position) / 8.0f;
-    
-    uint32_t e6 = push_halfEdge();
-    uint32_t e7 = push_halfEdge();
-    uint32_t e8 = push_halfEdge();
-    uint32_t e9 = push_halfEdge();
-    uint32_t e10 = push_halfEdge();
-    uint32_t e11 = push_halfEdge();
-
-    uint32_t f2 = push_triangle();
-    uint32_t f3 = push_triangle();
+    Index v4 = v;
+    this->positions[v4] = (3.0f * this->positions[v0] + 3.0f * this->positions[v1] + this->positions[v2] + this->positions[v3]) / 8.0f;
     
-    // update new structures
-    edge_next(e6) = e1;
-    edge_prev(e6) = e8;
-    edge_head(e6) = v4;
-    edge_pair(e6) = e3;
-    edge_left(e6) = f2;
-
-    edge_next(e7) = e2;
-    edge_prev(e7) = e0;
-    edge_head(e7) = v4;
-    edge_pair(e7) = e8;
-    edge_left(e7) = f0;
-
-    edge_next(e8) = e6;
-    edge_prev(e8) = e1;
-    edge_head(e8) = v2;
-    edge_pair(e8) = e7;
-    edge_left(e8) = f2;
-
-    edge_next(e9) = e4;
-    edge_prev(e9) = e11;
-    edge_head(e9) = v4;
-    edge_pair(e9) = e0;
-    edge_left(e9) = f3;
-
-    edge_next(e10) = e5;
-    edge_prev(e10) = e3;
-    edge_head(e10) = v4;
-    edge_pair(e10) = e11;
-    edge_left(e10) = f1;
-
-    edge_next(e11) = e9;
-    edge_prev(e11) = e4;
-    edge_head(e11) = v3;
-    edge_pair(e11) = e10;
-    edge_left(e11) = f3;
-
-    face_halfEdge(f2) = e6;
-    face_halfEdge(f3) = e9;
-    vertex_halfEdge(v4) = e6;
-
-    // update old structures
-    edge_next(e0) = e7;
-    edge_prev(e0) = e2;
-    edge_head(e0) = v0;
-    edge_pair(e0) = e9;
-    edge_left(e0) = f0;
-
-    edge_next(e1) = e8;
-    edge_prev(e1) = e6;
-    edge_head(e1) = v1;
-    edge_left(e1) = f2;
-
-    edge_next(e2) = e0;
-    edge_prev(e2) = e7;
-    edge_head(e2) = v2;
-    edge_left(e2) = f0;
-
-    edge_next(e3) = e10;
-    edge_prev(e3) = e5;
-    edge_head(e3) = v1;
-    edge_pair(e3) = e6;
-    edge_left(e3) = f1;
-
-    edge_next(e4) = e11;
-    edge_prev(e4) = e9;
-    edge_head(e4) = v0;
-    edge_left(e4) = f3;
-
-    edge_next(e5) = e3;
-    edge_prev(e5) = e10;
-    edge_head(e5) = v3;
-    edge_left(e5) = f1;
-
-    face_halfEdge(f0) = e0;
-    face_halfEdge(f1) = e3;
-    vertex_halfEdge(v0) = e0;
-    vertex_halfEdge(v1) = e1;
-    vertex_halfEdge(v2) = e2;
-    vertex_halfEdge(v3) = e5;
-  }
-}
-
-void Mesh::edge_flip(uint32_t i){
-  uint32_t e0 = i;
-  uint32_t e1 = edge_next(e0);
-  uint32_t e2 = edge_next(e1);
-  uint32_t e3 = edge_pair(e0);
-  uint32_t e4 = edge_next(e3);
-  uint32_t e5 = edge_next(e4);
+    Index f2 = fa;
+    Index f3 = fb;
+
+    set_face(f0, v0, v4, v2);
+    set_face(f2, v4, v1, v2);
+    set_face(f1, v1, v4, v3);
+    set_face(f3, v4, v0, v3);
+    Index a = face_halfEdge(f0);
+    Index b = face_halfEdge(f2);
+    Index c = face_halfEdge(f1);
+    Index d = face_halfEdge(f3);
+
+    link_halfEdges(a, d);
+    link_halfEdges(a + 1, b + 2);
+    link_halfEdges(a + 2, p2);
+    link_halfEdges(b, c);
+    link_halfEdges(b + 1, p1);
+    link_halfEdges(c + 1, d + 2);
+    link_halfEdges(c + 2, p5);
+    link_halfEdges(d + 1, p4);
+
+    vertex_halfEdge(v0) = ring_start(a);
+    vertex_halfEdge(v1) = ring_start(b + 1);
+    vertex_halfEdge(v2) = ring_start(a + 2);
+    vertex_halfEdge(v3) = ring_start(c + 2);
+    // the new vertex is surrounded by its four faces
+    vertex_halfEdge(v4) = b;
+  }
+}
+
+template <class Index>
+void BasicMesh<Index>::edge_flip(Index i){
+  invalidate_adjacency();
+  flip_edge(i);
+}
+
+// Like split_edge, writes only the two faces of the edge and its ends
+template <class Index>
+void BasicMesh<Index>::flip_edge(Index i){
+  Index e0 = i;
+  Index e1 = edge_next(e0);
+  Index e2 = edge_next(e1);
+  Index e3 = edge_pair(e0);
+  Index e4 = edge_next(e3);
+  Index e5 = edge_next(e4);
   
-  uint32_t v0 = edge_head(e0);
-  uint32_t v1 = edge_head(e1);
-  uint32_t v2 = edge_head(e2);
-  uint32_t v3 = edge_head(e5);
-
-  uint32_t f0 = edge_left(e0);
-  uint32_t f1 = edge_left(e3);
-
-  // update new structures
-  edge_next(e0) = e2;
-  edge_prev(e0) = e4;
-  edge_head(e0) = v3;
-  edge_pair(e0) = e3;
-  edge_left(e0) = f0;
-
-  edge_next(e1) = e3;
-  edge_prev(e1) = e5;
-  edge_head(e1) = v1;
-  edge_left(e1) = f1;
-
-  edge_next(e2) = e4;
-  edge_prev(e2) = e0;
-  edge_head(e2) = v2;
-  edge_left(e2) = f0;
-
-  edge_next(e3) = e5;
-  edge_prev(e3) = e1;
-  edge_head(e3) = v2;
-  edge_pair(e3) = e0;
-  edge_left(e3) = f1;
-
-  edge_next(e4) = e0;
-  edge_prev(e4) = e2;
-  edge_head(e4) = v0;
-  edge_left(e4) = f0;
-
-  edge_next(e5) = e1;
-  edge_prev(e5) = e3;
-  edge_head(e5) = v3;
-  edge_left(e5) = f1;
-
-  face_halfEdge(f0) = e0;
-  face_halfEdge(f1) = e1;
-
-  vertex_halfEdge(v0) = e4;
-  vertex_halfEdge(v1) = e1;
-  vertex_halfEdge(v2) = e2;
-  vertex_halfEdge(v3) = e5;
-}
-
-void Mesh::loop_subdivision(){
-    
-  uint32_t initial_vertex_count = this->vertices.size();
-  uint32_t initial_edge_count = this->halfEdges.size();
-  uint32_t initial_face_count = this->triangles.size();
-
-  // recording the new position of the vertices in the original mesh
-  glm::vec3* new_vertex_pos = new glm::vec3[this->vertices.size()];
-
-  for(uint32_t i=1; i<initial_vertex_count; i++){
-    Vertex& v = this->vertices[i];
-    uint32_t he = v.halfEdge;
-    {
-      uint32_t temp = he;
-      // anti-clockwise
-      do{
-        he = temp;
-        temp = edge_pair(edge_prev(he));
-        if(temp == v.halfEdge){
-          he = temp;
-          break;
-        }
-      }while(temp!=0);
+  Index v0 = edge_head(e0);
+  Index v1 = edge_head(e1);
+  Index v2 = edge_head(e2);
+  Index v3 = edge_head(e5);
+
+  Index p1 = edge_pair(e1);
+  Index p2 = edge_pair(e2);
+  Index p4 = edge_pair(e4);
+  Index p5 = edge_pair(e5);
+
+  Index f0 = edge_left(e0);
+  Index f1 = edge_left(e3);
+
+  // f0 becomes (v3, v2, v0) and f1 (v1, v2, v3)
+  set_face(f0, v3, v2, v0);
+  set_face(f1, v1, v2, v3);
+  Index a = face_halfEdge(f0);
+  Index b = face_halfEdge(f1);
+
+  link_halfEdges(a, b + 1);
+  link_halfEdges(a + 1, p2);
+  link_halfEdges(a + 2, p4);
+  link_halfEdges(b, p1);
+  link_halfEdges(b + 2, p5);
+
+  vertex_halfEdge(v0) = ring_start(a + 2);
+  vertex_halfEdge(v1) = ring_start(b);
+  vertex_halfEdge(v2) = ring_start(a + 1);
+  vertex_halfEdge(v3) = ring_start(b + 2);
+}
+
+template <class Index>
+bool BasicMesh<Index>::edge_collapsible(Index he){
+  Index e3 = edge_pair(he);
+  Index v0 = edge_head(he);
+  Index v1 = edge_head(edge_next(he));
+  Index v2 = edge_head(edge_prev(he));
+  Index v3 = e3 ? edge_head(edge_prev(e3)) : 0;
+  // a face with no other neighbour would leave its third corner behind
+  if (edge_pair(edge_next(he)) == 0 && edge_pair(edge_prev(he)) == 0) {
+    return false;
+  }
+  if (e3 != 0 && edge_pair(edge_next(e3)) == 0 && edge_pair(edge_prev(e3)) == 0) {
+    return false;
+  }
+  auto boundary = [&](Index v){
+    return edge_pair(edge_prev(vertex_halfEdge(v))) == 0;
+  };
+  if (e3 != 0 && boundary(v0) && boundary(v1)) {
+    return false;
+  }
+  for (Index u : vertex_neighbours(v1)) {
+    if (u == v0 || u == v2 || u == v3) {
+      continue;
     }
-    int count = 0;
-    // finding all the neighbours, clockwise
-    glm::vec3 temp(0.0f);
-    do{
-        temp += this->vertices[edge_head(edge_next(he))].position;
-        count++;
-        he = edge_pair(he);
-        if(he==0){
-          break;
-        }
-        he = edge_next(he);
+    for (Index w : vertex_neighbours(v0)) {
+      if (w == u) {
+        return false;
+      }
     }
-    while(he!=v.halfEdge);
-    float u = 0.0f;
-    if(count==3){
-        u = 3.0f/16.0f;
+  }
+  // an interior corner of valence 3 passes the link test only on a
+  // tetrahedron, which would fold into two faces
+  for (Index v : {v2, v3}) {
+    if (v != 0 && !boundary(v)) {
+      int valence = 0;
+      for (Index u : vertex_neighbours(v)) {
+        (void)u;
+        valence++;
+      }
+      if (valence <= 3) {
+        return false;
+      }
     }
-    else{
-        u = 3.0f/(8.0f*count);
+  }
+  return true;
+}
+
+// Collapses keep the faces at their slots: the removed faces are released
+// to the free lists, and the pairs on either side of each removed face are
+// linked to each other.
+template <class Index>
+Index BasicMesh<Index>::edge_collapse(Index he){
+  if (!edge_collapsible(he)) {
+    return 0;
+  }
+  invalidate_adjacency();
+  this->normalsValid = false;
+  Index v0 = edge_head(he);
+  Index f0 = edge_left(he);
+  Index f1 = edge_pair(he) ? edge_left(edge_pair(he)) : 0;
+  Index v1 = collapse_edge(he);
+  this->freeFaces.push_back(f0);
+  if (f1 != 0) {
+    this->freeFaces.push_back(f1);
+  }
+  this->freeVertices.push_back(v0);
+  return v1;
+}
+
+// Collapses he without the checks, marking the removed faces and vertex
+// deleted without putting them on the free lists. Like split_edge, it
+// writes only within the one-rings of the edge's ends and corners.
+template <class Index>
+Index BasicMesh<Index>::collapse_edge(Index he){
+  Index e3 = edge_pair(he);
+
+  Index v0 = edge_head(he);
+  Index v1 = edge_head(edge_next(he));
+  Index v2 = edge_head(edge_prev(he));
+  Index v3 = e3 ? edge_head(edge_prev(e3)) : 0;
+
+  Index p1 = edge_pair(edge_next(he));
+  Index p2 = edge_pair(edge_prev(he));
+  Index p4 = e3 ? edge_pair(edge_next(e3)) : 0;
+  Index p5 = e3 ? edge_pair(edge_prev(e3)) : 0;
+
+  //                 v1
+  //            --  |  --
+  //       p1 --    |    -- p5
+  //        --  f0  |  f1   --
+  // v2 ----------  he ---------- v3
+  //        --      |       --
+  //       p2 --    |    -- p4
+  //            --  |  --
+  //                 v0
+  // he runs from v0 to v1 and e3 back
+  // v0's half-edges start at v1 from now on
+  for (Index out : vertex_outgoing(v0)) {
+    edge_head(out) = v1;
+  }
+  auto join = [&](Index a, Index b){
+    if (a != 0) {
+      link_halfEdges(a, b);
+    } else {
+      edge_pair(b) = 0;
+    }
+  };
+  auto remove = [&](Index f){
+    Index first = face_halfEdge(f);
+    for (Index k = 0; k < 3; k++) {
+      this->halfEdges[first + k] = HalfEdge<Index>();
+    }
+  };
+  join(p1, p2);
+  remove(edge_left(he));
+  if (e3 != 0) {
+    join(p4, p5);
+    remove(edge_left(e3));
+  }
+  vertex_halfEdge(v0) = deletedIndex;
+
+  // p2 now leaves v1 and p1 leaves v2; the next half-edge of the other one
+  // does when one of them is a boundary
+  vertex_halfEdge(v1) = ring_start(p2 ? p2 : edge_next(p1));
+  vertex_halfEdge(v2) = ring_start(p1 ? p1 : edge_next(p2));
+  if (e3 != 0) {
+    vertex_halfEdge(v3) = ring_start(p4 ? p4 : edge_next(p5));
+  }
+  return v1;
+}
+
+// Deleted elements stay in place as tombstones until compact(): a deleted
+// vertex has deletedIndex as its half-edge, a deleted face head 0 and pair
+// 0 on all three half-edges. Their slots go on the free lists.
+template <class Index>
+void BasicMesh<Index>::release_vertex(Index v){
+  vertex_halfEdge(v) = deletedIndex;
+  this->freeVertices.push_back(v);
+}
+
+template <class Index>
+void BasicMesh<Index>::release_face(Index f){
+  Index first = face_halfEdge(f);
+  for (Index k = 0; k < 3; k++) {
+    this->halfEdges[first + k] = HalfEdge<Index>();
+  }
+  this->freeFaces.push_back(f);
+}
+
+template <class Index>
+bool BasicMesh<Index>::delete_face(Index f){
+  if (face_deleted(f)) {
+    return false;
+  }
+  Index first = face_halfEdge(f);
+  Index corners[3];
+  Index starts[3];
+  for (Index k = 0; k < 3; k++) {
+    Index he = first + k;
+    Index v = edge_head(he);
+    // the outgoing half-edges of v on either side of f
+    Index before = edge_pair(edge_prev(he));
+    Index after = edge_pair(he);
+    bool boundary = edge_pair(edge_prev(vertex_halfEdge(v))) == 0;
+    if (boundary && before != 0 && after != 0) {
+      return false;
+    }
+    corners[k] = v;
+    starts[k] = before ? before : (after ? edge_next(after) : 0);
+  }
+  invalidate_adjacency();
+  this->normalsValid = false;
+  for (Index k = 0; k < 3; k++) {
+    Index pair = edge_pair(first + k);
+    if (pair != 0) {
+      edge_pair(pair) = 0;
     }
-    temp = ((1-count*u)*v.position + u*temp);
-    new_vertex_pos[i] = temp; 
   }
+  release_face(f);
+  for (Index k = 0; k < 3; k++) {
+    vertex_halfEdge(corners[k]) = starts[k] ? ring_start(starts[k]) : 0;
+  }
+  return true;
+}
 
-  // split all the edges
-  for(uint32_t i=1; i<initial_edge_count; i++){
-    if (edge_pair(i) < i) {
-      edge_split(i);
+template <class Index>
+bool BasicMesh<Index>::delete_vertex(Index v){
+  if (v == 0 || vertex_deleted(v) || vertex_halfEdge(v) != 0) {
+    return false;
+  }
+  invalidate_adjacency();
+  release_vertex(v);
+  return true;
+}
+
+// Moves every kept vertex and face to its new index in the maps, 0 for
+// dropped ones, and rewrites all references to them. A half-edge keeps its
+// slot within its face.
+template <class Index>
+void BasicMesh<Index>::remap(const std::vector<Index>& vertexMap, size_t keptVertices, const std::vector<Index>& faceMap, size_t keptFaces){
+  auto mapHalfEdge = [&](Index he) -> Index {
+    return he == 0 ? 0 : 3 * faceMap[(he + 2) / 3] - 2 + (he - 1) % 3;
+  };
+  size_t numVertices = this->positions.size();
+  size_t numFaces = num_faces();
+  Buffer<glm::vec3> positions(keptVertices + 1);
+  Buffer<glm::vec3> normals(keptVertices + 1);
+  Buffer<Index> vertexHalfEdges(keptVertices + 1);
+  Buffer<HalfEdge<Index>> halfEdges(keptFaces ? 3 * keptFaces + 1 : 0);
+  parallel_for(numVertices - 1, [&](size_t i){
+    Index v = vertexMap[i + 1];
+    if (v != 0) {
+      positions[v] = this->positions[i + 1];
+      normals[v] = this->normals[i + 1];
+      vertexHalfEdges[v] = mapHalfEdge(this->vertexHalfEdges[i + 1]);
+    }
+  });
+  parallel_for(numFaces, [&](size_t i){
+    Index f = faceMap[i + 1];
+    if (f == 0) {
+      return;
+    }
+    for (Index k = 0; k < 3; k++) {
+      const HalfEdge<Index>& from = this->halfEdges[3 * i + 1 + k];
+      HalfEdge<Index>& to = halfEdges[3 * f - 2 + k];
+      to.pair = mapHalfEdge(from.pair);
+      to.head = vertexMap[from.head];
     }
+  });
+  this->positions = std::move(positions);
+  this->normals = std::move(normals);
+  this->vertexHalfEdges = std::move(vertexHalfEdges);
+  this->halfEdges = std::move(halfEdges);
+}
+
+template <class Index>
+void BasicMesh<Index>::compact(CompactOrder order, std::vector<Index>* vertexMapOut, std::vector<Index>* faceMapOut){
+  size_t numVertices = this->positions.size();
+  size_t numFaces = num_faces();
+  if (numVertices == 0) {
+    return;
   }
-  
-  // flip all the edges
-  for(uint32_t i=initial_edge_count + 2; i<this->halfEdges.size(); i+=3){
-    if(
-        ((edge_head(edge_next(i)) < initial_vertex_count) && (edge_head(i) >= initial_vertex_count)) ||
-        ((edge_head(edge_next(i)) >= initial_vertex_count) && (edge_head(i) < initial_vertex_count))
-      ){
-      edge_flip(i);
+  invalidate_adjacency();
+  this->normalsValid = false;
+  this->freeVertices.clear();
+  this->freeFaces.clear();
+  std::vector<Index> vertexMap(numVertices);
+  std::vector<Index> faceMap(numFaces + 1);
+  auto keepVertex = [&](size_t v){
+    return v != 0 && this->vertexHalfEdges[v] != deletedIndex;
+  };
+  size_t keptVertices = 0;
+  if (order == FaceOrder) {
+    // numbering by first use is inherently serial, but a single scan
+    for (size_t he = 1; he < this->halfEdges.size(); he++) {
+      Index v = this->halfEdges[he].head;
+      if (v != 0 && vertexMap[v] == 0) {
+        vertexMap[v] = ++keptVertices;
+      }
     }
+    for (size_t v = 1; v < numVertices; v++) {
+      if (vertexMap[v] == 0 && keepVertex(v)) {
+        vertexMap[v] = ++keptVertices;
+      }
+    }
+  } else {
+    keptVertices = renumber(numVertices, keepVertex, vertexMap);
+  }
+  size_t keptFaces = renumber(numFaces + 1, [&](size_t f){
+    return f != 0 && this->halfEdges[3 * f - 2].head != 0;
+  }, faceMap);
+  remap(vertexMap, keptVertices, faceMap, keptFaces);
+  if (vertexMapOut) {
+    vertexMapOut->swap(vertexMap);
   }
+  if (faceMapOut) {
+    faceMapOut->swap(faceMap);
+  }
+}
+
+// Loop subdivision writes the refined mesh straight from the coarse one.
+// Coarse face f becomes the corner faces 4f-3+s, s = 0, 1, 2, each holding
+// corner s of f, and the middle face 4f. Coarse half-edge h = 3f-2+k runs
+// from corner k to corner k+1; its first half is half-edge k of corner
+// face k and its second half is half-edge k of corner face k+1 (mod 3).
+namespace {
+
+template <class Index>
+Index first_half(Index h){
+  Index f = (h + 2) / 3;
+  Index k = (h - 1) % 3;
+  return 3 * (4 * f - 3 + k) - 2 + k;
+}
+
+template <class Index>
+Index second_half(Index h){
+  Index f = (h + 2) / 3;
+  Index k = (h - 1) % 3;
+  return 3 * (4 * f - 3 + (k + 1) % 3) - 2 + k;
+}
 
-  // set the new position of the vertices
-  for(uint32_t i=1; i<initial_vertex_count; i++){
-    this->vertices[i].position = new_vertex_pos[i];
+}
+
+template <class Index>
+bool BasicMesh<Index>::loop_subdivision(){
+  if (!this->freeVertices.empty() || !this->freeFaces.empty()) {
+    compact();
+  }
+  this->normalsValid = false;
+  size_t numVertices = this->positions.size();
+  size_t numHalfEdges = this->halfEdges.size();
+  size_t numFaces = num_faces();
+  if (numHalfEdges == 0) {
+    return true;
+  }
+
+  // Every edge gains a vertex, numbered after the old ones in the order of
+  // the half-edges that own the edges: the higher of a pair, or the only
+  // one on a boundary. Block counts, then a prefix sum over the blocks.
+  const size_t block = 4096;
+  size_t numBlocks = (numHalfEdges + block - 1) / block;
+  std::vector<size_t> blockEdges(numBlocks + 1, 0);
+  auto owner = [&](size_t h){
+    return h != 0 && edge_pair(h) < h;
+  };
+  parallel_blocks(numHalfEdges, block, [&](size_t first, size_t last){
+    size_t count = 0;
+    for (size_t h = first; h < last; h++) {
+      count += owner(h);
+    }
+    blockEdges[first / block + 1] = count;
+  });
+  for (size_t b = 0; b < numBlocks; b++) {
+    blockEdges[b + 1] += blockEdges[b];
+  }
+  size_t numEdges = blockEdges[numBlocks];
+  if (!fits(numVertices - 1 + numEdges, 4 * numFaces)) {
+    std::cerr << "Mesh: subdivision would overflow " << 8 * sizeof(Index) << "-bit indices" << std::endl;
+    return false;
   }
+  Buffer<Index> edgeVertex(numHalfEdges);
+  parallel_blocks(numHalfEdges, block, [&](size_t first, size_t last){
+    Index v = numVertices + blockEdges[first / block];
+    for (size_t h = first; h < last; h++) {
+      if (owner(h)) {
+        edgeVertex[h] = v++;
+      }
+    }
+  });
+  parallel_for(numHalfEdges - 1, [&](size_t i){
+    Index h = i + 1;
+    if (!owner(h)) {
+      edgeVertex[h] = edgeVertex[edge_pair(h)];
+    }
+  });
+
+  Buffer<glm::vec3> positions(numVertices + numEdges);
+  Buffer<Index> vertexHalfEdges(numVertices + numEdges);
+  Buffer<HalfEdge<Index>> halfEdges(12 * numFaces + 1);
+
+  // old vertices move towards the mean of their neighbours
+  parallel_for(numVertices - 1, [&](size_t i){
+    Index v = i + 1;
+    int count = 0;
+    // the far ends of the outgoing half-edges, clockwise
+    glm::vec3 temp(0.0f);
+    for (Index he : vertex_outgoing(v)) {
+      temp += this->positions[edge_head(edge_next(he))];
+      count++;
+    }
+    Index start = this->vertexHalfEdges[v];
+    vertexHalfEdges[v] = start ? first_half(start) : 0;
+    if (count == 0) {
+      // isolated vertex
+      positions[v] = this->positions[v];
+      return;
+    }
+    float u = count == 3 ? 3.0f / 16.0f : 3.0f / (8.0f * count);
+    positions[v] = (1 - count * u) * this->positions[v] + u * temp;
+  });
+
+  // edge points, and the edge vertex starts its ring at half-edge k + 1 of
+  // corner face k, whose previous half-edge is the first half of h. That is
+  // the half-edge following the boundary on a boundary edge.
+  parallel_for(numHalfEdges - 1, [&](size_t i){
+    Index h = i + 1;
+    if (!owner(h)) {
+      return;
+    }
+    Index v0 = edge_head(h);
+    Index v1 = edge_head(edge_next(h));
+    Index v = edgeVertex[h];
+    if (edge_pair(h) == 0) {
+      positions[v] = (this->positions[v0] + this->positions[v1]) / 2.0f;
+    } else {
+      Index v2 = edge_head(edge_prev(h));
+      Index v3 = edge_head(edge_prev(edge_pair(h)));
+      positions[v] = (3.0f * this->positions[v0] + 3.0f * this->positions[v1] + this->positions[v2] + this->positions[v3]) / 8.0f;
+    }
+    Index f = (h + 2) / 3;
+    Index k = (h - 1) % 3;
+    vertexHalfEdges[v] = 3 * (4 * f - 3 + k) - 2 + (k + 1) % 3;
+  });
+
+  // Corner face s holds corner s, the edge vertex of side s and that of
+  // side s - 1, at half-edges s, s + 1 and s + 2. Its half-edge s + 1 is
+  // inside the coarse face and pairs with half-edge s + 2 of the middle
+  // face, whose half-edge k runs between the edge vertices of sides k and
+  // k + 1.
+  auto set = [&](Index he, Index pair, Index head){
+    halfEdges[he].pair = pair;
+    halfEdges[he].head = head;
+  };
+  parallel_for(numFaces, [&](size_t i){
+    Index f = i + 1;
+    Index h = face_halfEdge(f);
+    Index middle = 3 * (4 * f) - 2;
+    for (Index s = 0; s < 3; s++) {
+      Index side = h + s;
+      Index before = h + (s + 2) % 3;
+      Index corner = 3 * (4 * f - 3 + s) - 2;
+      Index pair = edge_pair(side);
+      Index pairBefore = edge_pair(before);
+      set(corner + s, pair ? second_half(pair) : 0, edge_head(side));
+      set(corner + (s + 1) % 3, middle + (s + 2) % 3, edgeVertex[side]);
+      set(corner + (s + 2) % 3, pairBefore ? first_half(pairBefore) : 0, edgeVertex[before]);
+      set(middle + s, 3 * (4 * f - 3 + (s + 1) % 3) - 2 + (s + 2) % 3, edgeVertex[side]);
+    }
+  });
+
+  this->positions = std::move(positions);
+  this->vertexHalfEdges = std::move(vertexHalfEdges);
+  this->halfEdges = std::move(halfEdges);
+  this->normals = Buffer<glm::vec3>(this->positions.size());
+  invalidate_adjacency();
   recompute_normals();
+  return true;
 }
+
+bool load_mesh_data(const std::string& filename, MeshData& data, float weldTolerance, WeldStats* stats){
+  if (!read_mesh(filename, data)) {
+    return false;
+  }
+  if (weldTolerance >= 0) {
+    WeldStats welded = weld(data, weldTolerance);
+    if (stats) {
+      *stats = welded;
+    }
+  }
+  return true;
+}
+
+template class BasicMesh<uint16_t>;
+template class BasicMesh<uint32_t>;
+template class BasicMesh<uint64_t>;
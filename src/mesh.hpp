@@ -1,79 +1,494 @@
 #pragma once
+#include "buffer.hpp"
+#include "mesh_io.hpp"
+#include <array>
 #include <cstdint>
+#include <cstdlib>
 #include <glm/glm.hpp>
+#include <iostream>
+#include <limits>
 #include <memory>
+#include <string>
 #include <vector>
 
-struct HalfEdge;
-struct Face
+// Index checks in the accessors are compiled into debug (no NDEBUG) and
+// sanitizer builds. Define MESH_CHECKED to 0 or 1 to override.
+#ifndef MESH_CHECKED
+#if !defined(NDEBUG) || defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define MESH_CHECKED 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer) || __has_feature(memory_sanitizer)
+#define MESH_CHECKED 1
+#endif
+#endif
+#endif
+#ifndef MESH_CHECKED
+#define MESH_CHECKED 0
+#endif
+
+// Aborts with a message unless 0 < i < size, when checks are compiled in
+inline void mesh_check_index(uint64_t i, uint64_t size, const char* what){
+  if (MESH_CHECKED && (i == 0 || i >= size)) {
+    std::cerr << "Mesh: " << what << " " << i << " out of range [1, " << size << ")" << std::endl;
+    std::abort();
+  }
+}
+
+// Only the pair and the origin vertex are stored. Face f owns half-edges
+// 3f-2, 3f-1 and 3f in order, so next, prev and the left face follow from
+// the index.
+template <class Index>
+struct HalfEdge
 {
-    uint32_t halfEdge = 0;
+    Index pair = 0;
+    Index head = 0;
 };
-struct Vertex
+
+// What a one-ring circulator yields for each outgoing half-edge he of a
+// vertex: he itself, the far end head(next(he)), or the face left(he)
+enum RingKind { RingOutgoing, RingNeighbours, RingFaces };
+
+// Vertex numbering left by compact(): the current order, or the order in
+// which the faces in turn first use the vertices, so that the corners of
+// nearby faces get nearby indices
+enum CompactOrder { KeepOrder, FaceOrder };
+
+// A request to apply_edge_operations: edge_flip or edge_split of the edge
+// at halfEdge
+enum EdgeOperation { FlipEdge, SplitEdge };
+
+template <class Index>
+struct EdgeRequest
 {
-    uint32_t halfEdge = 0;
-    glm::vec3 normal;
-    glm::vec3 position;
+    Index halfEdge;
+    EdgeOperation operation;
 };
-struct HalfEdge
+
+// Walks the outgoing half-edges of a vertex clockwise in a single pass. It
+// starts at the vertex's stored half-edge, which for boundary vertices is
+// the one following the boundary (see Mesh::init), and stops where it
+// started or at the boundary. Neighbour walks that end at a boundary
+// yield one more vertex, the far end of the incoming boundary half-edge.
+template <class Mesh, class Index, RingKind Kind>
+class RingIterator
 {
-    uint32_t next = 0;
-    uint32_t prev = 0;
-    uint32_t pair = 0;
-    uint32_t head = 0;
-    uint32_t left = 0;
-};
+  public:
+    RingIterator(Mesh* mesh, Index start, Index he) : mesh(mesh), start(start), he(he){}
 
-template <class T1, class T2>
-struct hash_pair {
-    size_t operator()(const std::pair<T1, T2>& p) const
-    {
-        size_t hash1 = std::hash<T1>()(p.first);
-        size_t hash2 = std::hash<T2>()(p.second);
- 
-        if (hash1 != hash2) {
-            return hash1 ^ hash2;             
+    Index operator*() const {
+      if (Kind == RingOutgoing) {
+        return this->he;
+      }
+      if (Kind == RingFaces) {
+        return this->mesh->edge_left(this->he);
+      }
+      return this->tail ? this->mesh->edge_head(this->he) : this->mesh->edge_head(this->mesh->edge_next(this->he));
+    }
+    RingIterator& operator++(){
+      if (this->tail) {
+        this->tail = false;
+        this->he = 0;
+        return *this;
+      }
+      Index pair = this->mesh->edge_pair(this->he);
+      if (pair == 0) {
+        this->tail = Kind == RingNeighbours;
+        this->he = this->tail ? this->mesh->edge_prev(this->start) : 0;
+      } else {
+        this->he = this->mesh->edge_next(pair);
+        if (this->he == this->start) {
+          this->he = 0;
         }
-         
-        return hash1;
+      }
+      return *this;
     }
+    bool operator!=(const RingIterator& other) const {
+      return this->he != other.he || this->tail != other.tail;
+    }
+
+  private:
+    Mesh* mesh;
+    Index start;
+    Index he;
+    bool tail = false;
 };
 
-// Define a mesh data structure to store the connectivity and geometry of a triangle mesh
-class Mesh
+// Range over a one-ring for use in range-based for loops
+template <class Mesh, class Index, RingKind Kind>
+struct Ring
 {
+    Mesh* mesh;
+    Index start;
+
+    RingIterator<Mesh, Index, Kind> begin() const { return RingIterator<Mesh, Index, Kind>(this->mesh, this->start, this->start); }
+    RingIterator<Mesh, Index, Kind> end() const { return RingIterator<Mesh, Index, Kind>(this->mesh, this->start, 0); }
+};
+
+// Vertex adjacency in compressed sparse rows. The neighbours of v are
+// entries offsets[v] to offsets[v + 1] - 1, in the clockwise ring order of
+// Mesh::vertex_neighbours, so a boundary vertex ends with the far end of its
+// incoming boundary half-edge and has boundary[v] set. halfEdges holds the
+// half-edge joining v to each neighbour: the outgoing one, or the incoming
+// one for that last boundary entry.
+template <class Index>
+struct Adjacency
+{
+    Buffer<size_t> offsets;
+    Buffer<Index> neighbours;
+    Buffer<Index> halfEdges;
+    Buffer<uint8_t> boundary;
+    // (cot a + cot b) / 2 of the angles facing each edge, empty unless asked for
+    Buffer<float> cotanWeights;
+};
+
+// Sort key of an undirected edge, tagged with the half-edge it came from
+template <class Index>
+struct EdgeKey
+{
+    uint64_t key;
+    Index halfEdge;
+};
+
+// Define a mesh data structure to store the connectivity and geometry of a
+// triangle mesh. Index is the unsigned type of vertex, face and half-edge
+// indices (uint16_t, uint32_t or uint64_t); its largest value is reserved
+// to mark deleted vertices, so a mesh holds at most max-1 vertices and
+// half-edges.
+template <class Index>
+class BasicMesh
+{
+  template <class> friend class BasicMesh;
+
   private:
     /* data */
-    std::vector<Vertex> vertices;
-    std::vector<Face> triangles;
-    std::vector<HalfEdge> halfEdges;
+    // per-vertex attributes in separate arrays, indexed by vertex
+    Buffer<glm::vec3> positions;
+    Buffer<glm::vec3> normals;
+    Buffer<Index> vertexHalfEdges;
+    Buffer<HalfEdge<Index>> halfEdges;
+
+    // built on first use, dropped by every change to the connectivity
+    Adjacency<Index> adjacency;
+    bool adjacencyValid = false;
+
+    // face normals behind the vertex normals, and what changed since they
+    // were last computed (see update_normals); invalid after bulk changes
+    Buffer<glm::vec3> faceNormals;
+    std::vector<Index> movedVertices;
+    std::vector<Index> changedFaces;
+    bool normalsValid = false;
+
+    // slots of deleted vertices and faces, reused by push_vertex and
+    // push_triangle until compact() drops them
+    std::vector<Index> freeVertices;
+    std::vector<Index> freeFaces;
+
+    void pair_halfEdges(size_t numVertices);
+    void set_face(Index f, Index v0, Index v1, Index v2);
+    void link_halfEdges(Index a, Index b);
+    Index find_halfEdge(Index from, Index to);
+    Index ring_start(Index he);
+    void build_adjacency();
+    void update_cotan_weights();
+    // fallback for meshes too large for the vector kernels' 32-bit indices
+    void smoothing_scalar(int iter, float lambda, float mu);
+    void compute_face_normals(const Index* faces, size_t count);
+    void gather_normals(const Index* vertices, size_t count);
+    void touch_face(Index f);
+    // start of the ring walk at v, 0 for an empty ring
+    Index ring_first(Index v){
+      Index he = vertex_halfEdge(v);
+      return he == deletedIndex ? 0 : he;
+    }
+    void release_vertex(Index v);
+    void release_face(Index f);
+    // edge_split, edge_flip and edge_collapse without allocating or freeing
+    // slots or touching state shared by the whole mesh; normalsValid must
+    // be false while they run in parallel, or set_face records the faces
+    void split_edge(Index he, Index v, Index fa, Index fb);
+    void flip_edge(Index he);
+    Index collapse_edge(Index he);
+    void remap(const std::vector<Index>& vertexMap, size_t keptVertices, const std::vector<Index>& faceMap, size_t keptFaces);
 
   public:
-    Mesh(glm::vec3 *vertices, int numVertices, glm::vec3* normals, int numNormals, glm::ivec3 *triangles, int numTriangles);
-    Mesh(std::string filename);
-    void init(glm::vec3 *vertices, int numVertices, glm::vec3* normals, int numNormals, glm::ivec3 *triangles, int numTriangles);
+    static const Index maxIndex = std::numeric_limits<Index>::max() - 1;
+    // Half-edge of a deleted vertex
+    static const Index deletedIndex = std::numeric_limits<Index>::max();
+
+    // Whether a mesh with this many vertices and triangles fits the index type
+    static bool fits(size_t numVertices, size_t numTriangles){
+      return numVertices <= maxIndex && numTriangles <= maxIndex / 3;
+    }
+
+    BasicMesh(){}
+    BasicMesh(glm::vec3 *vertices, size_t numVertices, glm::vec3* normals, size_t numNormals, glm::ivec3 *triangles, size_t numTriangles);
+    // Loads an OBJ, PLY or STL file. With weldTolerance >= 0 the triangle
+    // soup is welded and cleaned up before connectivity is built. The mesh
+    // is left empty if the file cannot be read.
+    BasicMesh(std::string filename, float weldTolerance = -1.0f);
+    // Leaves the mesh empty if it does not fit the index type
+    void init(glm::vec3 *vertices, size_t numVertices, glm::vec3* normals, size_t numNormals, glm::ivec3 *triangles, size_t numTriangles);
+    // Copies the mesh into one with another index type. Fails if the mesh
+    // does not fit the narrower type.
+    template <class Other>
+    bool convert(BasicMesh<Other>& out) const;
+    // Area weighted vertex normals. Every vertex sums the normals of its own
+    // faces in ring order, so the pass runs in parallel without atomics and
+    // gives the same result for any number of threads. Vertices without
+    // faces, and the dummy vertex 0, get a zero normal.
     void recompute_normals();
+    // Recomputes only the normals around vertices moved since the last call
+    // (see touch_vertex) and faces rewritten by edge_flip and edge_split,
+    // with the same result as recompute_normals. Falls back to a full pass
+    // after bulk changes such as smoothing, subdivision or loading.
+    void update_normals();
     void smoothing(int iter, float lambda, float mu=0.0f);
+    // Implicit (backward Euler) fairing: one step solves (M + lambda L) x = M x0
+    // for the positions x with Jacobi preconditioned conjugate gradients. L is
+    // the uniform graph Laplacian with M the vertex degrees, or with cotan
+    // set the cotangent Laplacian with M the lumped vertex areas, scaled so
+    // lambda means about the same in both. Large lambda is stable and
+    // replaces many explicit iterations. Returns false if the relative
+    // residual is still above tolerance after maxIterations.
+    bool implicit_smoothing(float lambda, bool cotan = false, int maxIterations = 500, float tolerance = 1e-5f);
     void print();
     void view();
     void freeArrays();
+
+    // Native binary format storing the connectivity as-is, see mesh_io.cpp.
+    // The savers compact a mesh with deleted elements first.
+    // With view set the arrays borrow the mapped file instead of copying it.
+    // Loading fails on connectivity that would index out of bounds, with or
+    // without verify, which checks the checksum.
+    bool save_binary(const std::string& filename);
+    bool load_binary(const std::string& filename, bool view = false, bool verify = true);
+    // Exporters: text OBJ with per-vertex normals, binary PLY and binary STL
+    bool save_obj(const std::string& filename);
+    bool save_ply(const std::string& filename);
+    bool save_stl(const std::string& filename);
     
-    uint32_t& edge_next(uint32_t he);
-    uint32_t& edge_prev(uint32_t he);
-    uint32_t& edge_pair(uint32_t he);
-    uint32_t& edge_head(uint32_t he);
-    uint32_t& edge_left(uint32_t he);
+    // Connectivity accessors, inlined so one-ring walks compile to plain
+    // array accesses in release builds
+    Index edge_next(Index he){
+      mesh_check_index(he, this->halfEdges.size(), "half-edge");
+      return he % 3 == 0 ? he - 2 : he + 1;
+    }
+    Index edge_prev(Index he){
+      mesh_check_index(he, this->halfEdges.size(), "half-edge");
+      return he % 3 == 1 ? he + 2 : he - 1;
+    }
+    Index& edge_pair(Index he){
+      mesh_check_index(he, this->halfEdges.size(), "half-edge");
+      return this->halfEdges[he].pair;
+    }
+    Index& edge_head(Index he){
+      mesh_check_index(he, this->halfEdges.size(), "half-edge");
+      return this->halfEdges[he].head;
+    }
+    Index edge_left(Index he){
+      mesh_check_index(he, this->halfEdges.size(), "half-edge");
+      return (he + 2) / 3;
+    }
+
+    Index& vertex_halfEdge(Index v){
+      mesh_check_index(v, this->vertexHalfEdges.size(), "vertex");
+      return this->vertexHalfEdges[v];
+    }
+
+    // Whole per-vertex arrays, index 0 is the unused dummy vertex
+    Span<glm::vec3> vertex_positions() { return this->positions.span(); }
+    // Moves a vertex and marks it for update_normals
+    void set_vertex_position(Index v, const glm::vec3& p){
+      mesh_check_index(v, this->positions.size(), "vertex");
+      this->positions[v] = p;
+      touch_vertex(v);
+    }
+    // Marks a vertex moved through vertex_positions() for update_normals
+    void touch_vertex(Index v);
+    Span<glm::vec3> vertex_normals() { return this->normals.span(); }
+    Span<Index> vertex_halfEdges() { return this->vertexHalfEdges.span(); }
+
+    // One-ring circulators, e.g. for (Index u : mesh.vertex_neighbours(v)).
+    // Isolated and deleted vertices have empty rings.
+    Ring<BasicMesh, Index, RingOutgoing> vertex_outgoing(Index v){
+      return Ring<BasicMesh, Index, RingOutgoing>{this, ring_first(v)};
+    }
+    Ring<BasicMesh, Index, RingNeighbours> vertex_neighbours(Index v){
+      return Ring<BasicMesh, Index, RingNeighbours>{this, ring_first(v)};
+    }
+    Ring<BasicMesh, Index, RingFaces> vertex_faces(Index v){
+      return Ring<BasicMesh, Index, RingFaces>{this, ring_first(v)};
+    }
+    // Corners of a face in order
+    std::array<Index, 3> face_vertices(Index f){
+      Index he = face_halfEdge(f);
+      return std::array<Index, 3>{{this->halfEdges[he].head, this->halfEdges[he + 1].head, this->halfEdges[he + 2].head}};
+    }
 
-    uint32_t& vertex_halfEdge(uint32_t v);
+    // Cached CSR vertex adjacency, rebuilt after init, push_*, edge_flip or
+    // edge_split. Writes through the reference accessors are not tracked.
+    // Cotangent weights depend on the positions and are recomputed on every
+    // call that asks for them.
+    const Adjacency<Index>& vertex_adjacency(bool cotanWeights = false);
+    void invalidate_adjacency(){
+      this->adjacencyValid = false;
+    }
 
-    uint32_t& face_halfEdge(uint32_t f);
+    Index face_halfEdge(Index f){
+      mesh_check_index(f, num_faces() + 1, "face");
+      return 3 * f - 2;
+    }
+    Index num_faces(){
+      return this->halfEdges.empty() ? 0 : (this->halfEdges.size() - 1) / 3;
+    }
     
-    uint32_t push_vertex();
-    uint32_t push_triangle();
-    uint32_t push_halfEdge();
+    // Both reuse the slot of a deleted vertex or face if there is one, and
+    // append otherwise
+    Index push_vertex();
+    // Adds a face together with its three half-edges
+    Index push_triangle();
 
-    void edge_flip(uint32_t he);
-    void edge_split(uint32_t he);
+    void edge_flip(Index he);
+    void edge_split(Index he);
+    // Applies a batch of flips and splits in rounds of edges whose one-rings
+    // do not overlap, each round in parallel (see edge_batch.cpp). Edges are
+    // named by their half-edges when the call starts. A request is skipped
+    // if its edge is gone by its turn, as after an earlier request for the
+    // same edge, and a flip also if the edge is on the boundary or the new
+    // edge exists already. results, if given, gets for each
+    // request the new vertex of a split, a half-edge of the flipped edge, or
+    // 0 if skipped. The result depends on the order of the batch, not on
+    // the number of threads. Returns false, leaving the mesh unchanged, if
+    // the splits would not fit the index type.
+    bool apply_edge_operations(const std::vector<EdgeRequest<Index>>& requests, std::vector<Index>* results = nullptr);
+    // Whether collapsing he keeps the mesh manifold: the two ends share no
+    // neighbours but the corners opposite the edge (link condition), an
+    // interior edge does not join two boundary vertices, and no corner is
+    // left without faces.
+    bool edge_collapsible(Index he);
+    // Merges the origin of he into its far end, which keeps its position,
+    // and returns the far end, or 0 without changes if the edge is not
+    // collapsible. The faces of the edge and the origin are only marked
+    // deleted, so all other indices stay valid until compact().
+    Index edge_collapse(Index he);
+    bool face_deleted(Index f){
+      return edge_head(face_halfEdge(f)) == 0;
+    }
+    bool vertex_deleted(Index v){
+      return vertex_halfEdge(v) == deletedIndex;
+    }
+    // Removes face f and unlinks its pairs, leaving a hole. Fails if f is
+    // already deleted or if one of its corners is a boundary vertex with
+    // faces on both sides of f, which would no longer be manifold.
+    // Corners left without faces stay as isolated vertices.
+    bool delete_face(Index f);
+    // Removes a vertex that has no faces; fails for any other vertex
+    bool delete_vertex(Index v);
+    // Drops deleted faces and vertices in one linear pass over the arrays.
+    // Faces keep their order; vertices keep theirs or, with FaceOrder, are
+    // renumbered by first use, with isolated vertices last. vertexMap and
+    // faceMap, if given, receive the new index of every old vertex and face,
+    // 0 for deleted ones. Subdivision and the savers compact first; other
+    // whole-mesh passes (normals, smoothing, viewing) expect a mesh without
+    // deleted elements.
+    void compact(CompactOrder order = KeepOrder, std::vector<Index>* vertexMap = nullptr, std::vector<Index>* faceMap = nullptr);
+    // Renumbers the mesh for memory locality (see reorder.cpp): vertices
+    // along a Hilbert curve through their bounding box, so one-ring walks
+    // stay within nearby cache lines, and faces in the order of a vertex
+    // cache of cacheSize entries (Tipsify), so drawing transforms each
+    // vertex about once. Half-edges follow their faces. Compacts first if
+    // anything is deleted.
+    void reorder(int cacheSize = 16);
 
-    void loop_subdivision();
+    // Quadric error metric decimation by edge collapses, cheapest first (see
+    // decimate.cpp), until at most targetFaces faces are left or the next
+    // collapse would move the surface by more than about maxError. Boundaries
+    // are kept in place and collapses that would fold a face are skipped.
+    // Compacts the mesh and recomputes the normals at the end.
+    void decimate(size_t targetFaces, float maxError = std::numeric_limits<float>::infinity());
+
+    // Isotropic remeshing towards edges of targetLength (see remesh.cpp):
+    // every iteration splits edges longer than 4/3 of it, collapses edges
+    // shorter than 4/5 of it, flips edges towards valence 6 (4 on the
+    // boundary) and moves vertices towards the centroid of their neighbours
+    // within the tangent plane. Boundary vertices stay in place. Returns
+    // false, with the mesh valid but not finished, if the splits would not
+    // fit the index type.
+    bool remesh(float targetLength, int iterations = 5);
+
+    // One step of Loop subdivision, written in a single parallel pass: old
+    // vertices keep their indices and edge vertices follow in the order of
+    // the half-edges that own the edges. A mesh with deleted elements is
+    // compacted first. Returns false, leaving the mesh otherwise untouched,
+    // if the subdivided mesh would not fit the index type; convert() to a
+    // wider one first.
+    bool loop_subdivision();
+
+    // Loop limit surface of the current mesh, for the rules loop_subdivision
+    // applies, without subdividing it (see loop_limit.cpp). limit_vertices
+    // gives every vertex its limit position and unit normal from the
+    // eigenvector masks of its ring; index 0 is the dummy vertex.
+    void limit_vertices(std::vector<glm::vec3>& positions, std::vector<glm::vec3>& normals);
+    // Limit positions and unit normals at count points, each given by a face
+    // and barycentric weights of its corners in order. The vertices that k
+    // subdivision steps would create lie at weights with denominator 2^k.
+    void limit_points(const Index* faces, const glm::vec3* barycentric, size_t count, glm::vec3* positions, glm::vec3* normals);
 };
+
+typedef BasicMesh<uint16_t> Mesh16;
+typedef BasicMesh<uint32_t> Mesh;
+typedef BasicMesh<uint64_t> Mesh64;
+
+// Reads a mesh file and welds it like the file constructor does, storing
+// the weld counts in stats if given
+bool load_mesh_data(const std::string& filename, MeshData& data, float weldTolerance = -1.0f, WeldStats* stats = nullptr);
+
+// Loads a mesh file into the narrowest of Mesh16, Mesh and Mesh64 that holds
+// it and calls visitor(mesh). Returns false if the file could not be read.
+template <class Visitor>
+bool visit_mesh(const std::string& filename, Visitor visitor, float weldTolerance = -1.0f){
+  MeshData data;
+  if (!load_mesh_data(filename, data, weldTolerance)) {
+    return false;
+  }
+  size_t numVertices = data.vertices.size();
+  size_t numTriangles = data.triangles.size();
+  if (Mesh16::fits(numVertices, numTriangles)) {
+    Mesh16 mesh(data.vertices.data(), numVertices, data.normals.data(), data.normals.size(), data.triangles.data(), numTriangles);
+    visitor(mesh);
+  } else if (Mesh::fits(numVertices, numTriangles)) {
+    Mesh mesh(data.vertices.data(), numVertices, data.normals.data(), data.normals.size(), data.triangles.data(), numTriangles);
+    visitor(mesh);
+  } else {
+    Mesh64 mesh(data.vertices.data(), numVertices, data.normals.data(), data.normals.size(), data.triangles.data(), numTriangles);
+    visitor(mesh);
+  }
+  return true;
+}
+
+template <class Index>
+template <class Other>
+bool BasicMesh<Index>::convert(BasicMesh<Other>& out) const {
+  size_t numVertices = this->positions.empty() ? 0 : this->positions.size() - 1;
+  size_t numTriangles = this->halfEdges.size() / 3;
+  if (!BasicMesh<Other>::fits(numVertices, numTriangles)) {
+    std::cerr << "Mesh: " << numVertices << " vertices and " << numTriangles << " triangles do not fit " << 8 * sizeof(Other) << "-bit indices" << std::endl;
+    return false;
+  }
+  out.freeArrays();
+  out.positions = this->positions;
+  out.normals = this->normals;
+  out.vertexHalfEdges.resize(this->vertexHalfEdges.size());
+  for (size_t i = 0; i < this->vertexHalfEdges.size(); i++) {
+    Index he = this->vertexHalfEdges[i];
+    out.vertexHalfEdges[i] = he == deletedIndex ? BasicMesh<Other>::deletedIndex : (Other)he;
+  }
+  out.halfEdges.resize(this->halfEdges.size());
+  for (size_t i = 0; i < this->halfEdges.size(); i++) {
+    out.halfEdges[i].pair = (Other)this->halfEdges[i].pair;
+    out.halfEdges[i].head = (Other)this->halfEdges[i].head;
+  }
+  out.freeVertices.assign(this->freeVertices.begin(), this->freeVertices.end());
+  out.freeFaces.assign(this->freeFaces.begin(), this->freeFaces.end());
+  return true;
+}
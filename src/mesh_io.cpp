@@ -0,0 +1,1768 @@
+#include "mesh_io.hpp"
+#include "mesh.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <glm/geometric.hpp>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& filename, bool writable){
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    // private writable mappings are copy-on-write, the file is never modified
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* p = mmap(nullptr, st.st_size, prot, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      this->data = static_cast<char*>(p);
+      this->size = st.st_size;
+      if (!writable) {
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+      }
+    }
+  }
+  close(fd);
+}
+
+MappedFile::~MappedFile(){
+  if (this->data) {
+    munmap(this->data, this->size);
+  }
+}
+
+namespace {
+
+bool host_little_endian(){
+  uint32_t x = 1;
+  uint8_t b;
+  memcpy(&b, &x, 1);
+  return b == 1;
+}
+
+inline bool is_digit(char c){
+  return (unsigned)(c - '0') < 10u;
+}
+
+inline const char* skip_space(const char* p, const char* end){
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+    p++;
+  }
+  return p;
+}
+
+inline const char* next_line(const char* p, const char* end){
+  const char* nl = static_cast<const char*>(memchr(p, '\n', end - p));
+  return nl ? nl + 1 : end;
+}
+
+// Removes the triangles with a corner outside the vertex array and returns
+// how many there were, so that bad indices in a file never reach
+// Mesh::init. Files without any are only scanned, in parallel.
+size_t drop_invalid_triangles(MeshData& data){
+  long long numVertices = data.vertices.size();
+  auto invalid = [&](const glm::ivec3& t){
+    return t.x < 0 || t.y < 0 || t.z < 0 || t.x >= numVertices || t.y >= numVertices || t.z >= numVertices;
+  };
+  const size_t block = 65536;
+  size_t n = data.triangles.size();
+  std::vector<char> bad((n + block - 1) / block, 0);
+  parallel_for(bad.size(), [&](size_t b){
+    size_t last = std::min(n, (b + 1) * block);
+    for (size_t t = b * block; t < last; t++) {
+      bad[b] |= invalid(data.triangles[t]);
+    }
+  });
+  if (std::find(bad.begin(), bad.end(), 1) == bad.end()) {
+    return 0;
+  }
+  auto kept = std::remove_if(data.triangles.begin(), data.triangles.end(), invalid);
+  size_t dropped = data.triangles.end() - kept;
+  data.triangles.erase(kept, data.triangles.end());
+  return dropped;
+}
+
+// Locale-free integer parser, advances p past the number
+inline bool parse_int(const char*& p, const char* end, long long& out){
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = *p == '-';
+    p++;
+  }
+  if (p >= end || !is_digit(*p)) {
+    return false;
+  }
+  long long v = 0;
+  while (p < end && is_digit(*p)) {
+    v = v * 10 + (*p - '0');
+    p++;
+  }
+  out = neg ? -v : v;
+  return true;
+}
+
+// Locale-free float parser: accumulates up to 19 significant digits into an
+// integer mantissa and scales once by an exact power of ten
+inline bool parse_float(const char*& p, const char* end, float& out){
+  static const double pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = *p == '-';
+    p++;
+  }
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool any = false;
+  while (p < end && is_digit(*p)) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*p - '0');
+      if (mantissa) digits++;
+    } else {
+      exponent++;
+    }
+    any = true;
+    p++;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && is_digit(*p)) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*p - '0');
+        if (mantissa) digits++;
+        exponent--;
+      }
+      any = true;
+      p++;
+    }
+  }
+  if (!any) {
+    return false;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char* q = p + 1;
+    long long e;
+    if (parse_int(q, end, e)) {
+      exponent += (int)std::max(-400LL, std::min(400LL, e));
+      p = q;
+    }
+  }
+  double v = (double)mantissa;
+  if (exponent < 0) {
+    if (exponent >= -22) {
+      v /= pow10[-exponent];
+    } else {
+      v *= std::pow(10.0, exponent);
+    }
+  } else if (exponent > 0) {
+    if (exponent <= 22) {
+      v *= pow10[exponent];
+    } else {
+      v *= std::pow(10.0, exponent);
+    }
+  }
+  out = (float)(neg ? -v : v);
+  return true;
+}
+
+// Face corners and normals parsed from one newline-aligned slice of the
+// file. Negative OBJ indices can only be resolved once the number of
+// elements in the preceding chunks is known, so they are stored relative to
+// the start of the chunk and listed for fix-up during the merge.
+struct ObjChunk
+{
+    std::vector<glm::vec3> vertices;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::ivec3> triangles;
+    // positions (3 * triangle + corner) of chunk-relative vertex indices
+    std::vector<size_t> relativeCorners;
+    // v//vn references in file order, with chunk-relative flags
+    struct NormalRef
+    {
+        int vertex;
+        int normal;
+        bool vertexRelative;
+        bool normalRelative;
+    };
+    std::vector<NormalRef> normalRefs;
+};
+
+// Resolves a 1-based OBJ index to a 0-based one. Negative indices are
+// resolved against the count seen so far in the chunk and flagged. Index 0
+// and indices past the int range give -1, which the range check drops.
+inline int resolve_index(long long idx, size_t count, bool& relative){
+  const long long limit = std::numeric_limits<int>::max();
+  relative = idx < 0;
+  if (idx == 0 || idx > limit || idx < -limit) {
+    relative = false;
+    return -1;
+  }
+  return idx > 0 ? (int)(idx - 1) : (int)(count + idx);
+}
+
+void parse_obj_chunk(const char* p, const char* end, ObjChunk& out){
+  while (p < end) {
+    p = skip_space(p, end);
+    if (p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+      const char* q = p + 2;
+      glm::vec3 vertex;
+      for (int i = 0; i < 3; i++) {
+        q = skip_space(q, end);
+        parse_float(q, end, vertex[i]);
+      }
+      out.vertices.push_back(vertex);
+      p = q;
+    } else if (p + 2 < end && p[0] == 'v' && p[1] == 'n' && (p[2] == ' ' || p[2] == '\t')) {
+      const char* q = p + 3;
+      glm::vec3 normal;
+      for (int i = 0; i < 3; i++) {
+        q = skip_space(q, end);
+        parse_float(q, end, normal[i]);
+      }
+      out.normals.push_back(normal);
+      p = q;
+    } else if (p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+      const char* q = p + 2;
+      int corner = 0;
+      int first = 0, prev = 0;
+      bool firstRelative = false, prevRelative = false;
+      while (true) {
+        q = skip_space(q, end);
+        long long v, vt, vn;
+        if (!parse_int(q, end, v)) {
+          break;
+        }
+        bool relative;
+        int vi = resolve_index(v, out.vertices.size(), relative);
+        if (q < end && *q == '/') {
+          q++;
+          if (q < end && *q != '/') {
+            parse_int(q, end, vt);
+          }
+          if (q < end && *q == '/') {
+            q++;
+            if (parse_int(q, end, vn)) {
+              ObjChunk::NormalRef ref;
+              ref.vertex = vi;
+              ref.vertexRelative = relative;
+              ref.normal = resolve_index(vn, out.normals.size(), ref.normalRelative);
+              out.normalRefs.push_back(ref);
+            }
+          }
+        }
+        // fan triangulation of polygons
+        if (corner == 0) {
+          first = vi;
+          firstRelative = relative;
+        } else if (corner >= 2) {
+          size_t t = out.triangles.size();
+          out.triangles.push_back(glm::ivec3(first, prev, vi));
+          if (firstRelative) out.relativeCorners.push_back(3 * t);
+          if (prevRelative) out.relativeCorners.push_back(3 * t + 1);
+          if (relative) out.relativeCorners.push_back(3 * t + 2);
+        }
+        prev = vi;
+        prevRelative = relative;
+        corner++;
+      }
+      p = q;
+    }
+    p = next_line(p, end);
+  }
+}
+
+}
+
+bool read_obj(const std::string& filename, MeshData& out){
+  out.vertices.clear();
+  out.normals.clear();
+  out.triangles.clear();
+
+  MappedFile file(filename);
+  if (!file.data) {
+    std::cerr << "Could not read " << filename << std::endl;
+    return false;
+  }
+  const char* begin = file.data;
+  const char* end = file.data + file.size;
+
+  // split at newline boundaries, small files are parsed by a single chunk
+  const size_t minChunkSize = 1 << 20;
+  size_t numChunks = std::max<size_t>(1, std::min<size_t>(num_threads(), file.size / minChunkSize));
+  std::vector<const char*> bounds(numChunks + 1, end);
+  bounds[0] = begin;
+  for (size_t c = 1; c < numChunks; c++) {
+    bounds[c] = std::max(bounds[c - 1], next_line(begin + file.size * c / numChunks, end));
+  }
+
+  std::vector<ObjChunk> chunks(numChunks);
+  parallel_for(numChunks, [&](size_t c){
+    parse_obj_chunk(bounds[c], bounds[c + 1], chunks[c]);
+  });
+
+  // prefix sums give every chunk its slice of the merged arrays
+  std::vector<size_t> vertexBase(numChunks + 1, 0), normalBase(numChunks + 1, 0), triangleBase(numChunks + 1, 0);
+  for (size_t c = 0; c < numChunks; c++) {
+    vertexBase[c + 1] = vertexBase[c] + chunks[c].vertices.size();
+    normalBase[c + 1] = normalBase[c] + chunks[c].normals.size();
+    triangleBase[c + 1] = triangleBase[c] + chunks[c].triangles.size();
+  }
+  out.vertices.resize(vertexBase[numChunks]);
+  out.normals.resize(normalBase[numChunks]);
+  out.triangles.resize(triangleBase[numChunks]);
+  parallel_for(numChunks, [&](size_t c){
+    ObjChunk& chunk = chunks[c];
+    std::copy(chunk.vertices.begin(), chunk.vertices.end(), out.vertices.begin() + vertexBase[c]);
+    std::copy(chunk.normals.begin(), chunk.normals.end(), out.normals.begin() + normalBase[c]);
+    glm::ivec3* triangles = out.triangles.data() + triangleBase[c];
+    std::copy(chunk.triangles.begin(), chunk.triangles.end(), triangles);
+    for (size_t i : chunk.relativeCorners) {
+      triangles[i / 3][i % 3] += (int)vertexBase[c];
+    }
+    std::vector<glm::vec3>().swap(chunk.vertices);
+    std::vector<glm::vec3>().swap(chunk.normals);
+    std::vector<glm::ivec3>().swap(chunk.triangles);
+  });
+  size_t dropped = drop_invalid_triangles(out);
+  if (dropped > 0) {
+    std::cerr << filename << ": dropped " << dropped << " faces with vertex indices out of range" << std::endl;
+  }
+
+  // reorder normals to follow the vertices they are attached to, later
+  // references win as in a serial parse
+  bool indexedNormals = false;
+  for (size_t c = 0; c < numChunks; c++) {
+    indexedNormals |= !chunks[c].normalRefs.empty();
+  }
+  if (indexedNormals) {
+    std::vector<glm::vec3> normals(out.vertices.size(), glm::vec3(0.0f));
+    for (size_t c = 0; c < numChunks; c++) {
+      for (const ObjChunk::NormalRef& ref : chunks[c].normalRefs) {
+        int v = ref.vertex + (ref.vertexRelative ? (int)vertexBase[c] : 0);
+        int n = ref.normal + (ref.normalRelative ? (int)normalBase[c] : 0);
+        if (v >= 0 && v < (int)normals.size() && n >= 0 && n < (int)out.normals.size()) {
+          normals[v] = out.normals[n];
+        }
+      }
+    }
+    out.normals.swap(normals);
+  }
+  return true;
+}
+
+// PLY reader for the ascii, binary_little_endian and binary_big_endian
+// encodings. Only x/y/z, nx/ny/nz and the face index lists are decoded;
+// every other property is skipped by its byte size.
+namespace {
+
+enum PlyType { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_INVALID };
+
+PlyType ply_type(const std::string& name){
+  if (name == "char" || name == "int8") return PLY_INT8;
+  if (name == "uchar" || name == "uint8") return PLY_UINT8;
+  if (name == "short" || name == "int16") return PLY_INT16;
+  if (name == "ushort" || name == "uint16") return PLY_UINT16;
+  if (name == "int" || name == "int32") return PLY_INT32;
+  if (name == "uint" || name == "uint32") return PLY_UINT32;
+  if (name == "float" || name == "float32") return PLY_FLOAT32;
+  if (name == "double" || name == "float64") return PLY_FLOAT64;
+  return PLY_INVALID;
+}
+
+size_t ply_size(PlyType t){
+  static const size_t sizes[] = {1, 1, 2, 2, 4, 4, 4, 8, 0};
+  return sizes[t];
+}
+
+// Decodes one binary scalar, byte-swapping when the file endianness differs
+double ply_read(const char* p, PlyType t, bool swap){
+  char b[8];
+  size_t n = ply_size(t);
+  if (swap) {
+    for (size_t i = 0; i < n; i++) {
+      b[i] = p[n - 1 - i];
+    }
+  } else {
+    memcpy(b, p, n);
+  }
+  switch (t) {
+    case PLY_INT8: { int8_t v; memcpy(&v, b, 1); return v; }
+    case PLY_UINT8: { uint8_t v; memcpy(&v, b, 1); return v; }
+    case PLY_INT16: { int16_t v; memcpy(&v, b, 2); return v; }
+    case PLY_UINT16: { uint16_t v; memcpy(&v, b, 2); return v; }
+    case PLY_INT32: { int32_t v; memcpy(&v, b, 4); return v; }
+    case PLY_UINT32: { uint32_t v; memcpy(&v, b, 4); return v; }
+    case PLY_FLOAT32: { float v; memcpy(&v, b, 4); return v; }
+    case PLY_FLOAT64: { double v; memcpy(&v, b, 8); return v; }
+    default: return 0;
+  }
+}
+
+struct PlyProperty
+{
+    std::string name;
+    PlyType type = PLY_INVALID;
+    // list properties store a count of type countType followed by items of type
+    bool list = false;
+    PlyType countType = PLY_INVALID;
+    size_t offset = 0;
+};
+
+struct PlyElement
+{
+    std::string name;
+    size_t count = 0;
+    std::vector<PlyProperty> properties;
+    // byte stride of one record, 0 if the element has list properties
+    size_t stride = 0;
+
+    int find(const std::string& name) const {
+      for (size_t i = 0; i < this->properties.size(); i++) {
+        if (this->properties[i].name == name) {
+          return (int)i;
+        }
+      }
+      return -1;
+    }
+};
+
+// Skips one binary record of an element with list properties
+const char* ply_skip_record(const char* p, const char* end, const PlyElement& e, bool swap){
+  for (const PlyProperty& prop : e.properties) {
+    if (p >= end) {
+      return end;
+    }
+    if (prop.list) {
+      size_t n = (size_t)ply_read(p, prop.countType, swap);
+      p += ply_size(prop.countType) + n * ply_size(prop.type);
+    } else {
+      p += ply_size(prop.type);
+    }
+  }
+  return p;
+}
+
+// Converts a list item to a vertex index, or -1 if it names no vertex or
+// does not fit the int indices of MeshData
+long long ply_index(double v, long long numVertices){
+  return v >= 0 && v < (double)numVertices ? (long long)v : -1;
+}
+
+// Fans the polygon into triangles, or drops it and returns false if any of
+// its indices is invalid
+bool ply_add_polygon(MeshData& out, const std::vector<long long>& polygon){
+  for (long long i : polygon) {
+    if (i < 0) {
+      return false;
+    }
+  }
+  for (size_t k = 2; k < polygon.size(); k++) {
+    out.triangles.push_back(glm::ivec3((int)polygon[0], (int)polygon[k - 1], (int)polygon[k]));
+  }
+  return true;
+}
+
+}
+
+bool read_ply(const std::string& filename, MeshData& out){
+  out.vertices.clear();
+  out.normals.clear();
+  out.triangles.clear();
+
+  MappedFile file(filename);
+  if (!file.data) {
+    std::cerr << "Could not read " << filename << std::endl;
+    return false;
+  }
+  const char* p = file.data;
+  const char* end = file.data + file.size;
+
+  // header
+  enum { ASCII, LITTLE, BIG } format = ASCII;
+  std::vector<PlyElement> elements;
+  bool headerDone = false;
+  bool magic = false;
+  while (p < end && !headerDone) {
+    const char* eol = next_line(p, end);
+    std::istringstream line(std::string(p, eol));
+    p = eol;
+    std::string word;
+    line >> word;
+    if (!magic) {
+      magic = word == "ply";
+      if (!magic) {
+        break;
+      }
+    } else if (word == "format") {
+      line >> word;
+      format = word == "binary_little_endian" ? LITTLE : word == "binary_big_endian" ? BIG : ASCII;
+    } else if (word == "element") {
+      PlyElement e;
+      line >> e.name >> e.count;
+      elements.push_back(e);
+    } else if (word == "property" && !elements.empty()) {
+      PlyProperty prop;
+      line >> word;
+      if (word == "list") {
+        std::string countType, itemType;
+        line >> countType >> itemType >> prop.name;
+        prop.list = true;
+        prop.countType = ply_type(countType);
+        prop.type = ply_type(itemType);
+      } else {
+        prop.type = ply_type(word);
+        line >> prop.name;
+      }
+      if (prop.type == PLY_INVALID || (prop.list && prop.countType == PLY_INVALID)) {
+        std::cerr << filename << ": unsupported PLY property type" << std::endl;
+        return false;
+      }
+      elements.back().properties.push_back(prop);
+    } else if (word == "end_header") {
+      headerDone = true;
+    }
+  }
+  if (!magic || !headerDone) {
+    std::cerr << filename << ": not a PLY file" << std::endl;
+    return false;
+  }
+  for (PlyElement& e : elements) {
+    size_t offset = 0;
+    bool fixed = true;
+    for (PlyProperty& prop : e.properties) {
+      prop.offset = offset;
+      offset += ply_size(prop.type);
+      fixed = fixed && !prop.list;
+    }
+    e.stride = fixed ? offset : 0;
+  }
+  bool swap = (format == BIG) == host_little_endian();
+  long long numVertices = 0;
+  for (const PlyElement& e : elements) {
+    if (e.name == "vertex") {
+      numVertices = (long long)std::min<size_t>(e.count, (size_t)std::numeric_limits<int>::max() + 1);
+    }
+  }
+
+  std::vector<long long> polygon;
+  size_t dropped = 0;
+  for (const PlyElement& e : elements) {
+    bool isVertex = e.name == "vertex";
+    bool isFace = e.name == "face";
+    int position[3] = {e.find("x"), e.find("y"), e.find("z")};
+    int normal[3] = {e.find("nx"), e.find("ny"), e.find("nz")};
+    bool hasNormals = isVertex && normal[0] >= 0 && normal[1] >= 0 && normal[2] >= 0;
+    int indices = e.find("vertex_indices");
+    if (indices < 0) {
+      indices = e.find("vertex_index");
+    }
+    if (isVertex) {
+      out.vertices.resize(e.count);
+      if (hasNormals) {
+        out.normals.resize(e.count);
+      }
+    }
+
+    if (format == ASCII) {
+      std::vector<double> values;
+      for (size_t r = 0; r < e.count && p < end; r++) {
+        const char* eol = next_line(p, end);
+        values.clear();
+        polygon.clear();
+        for (size_t i = 0; i < e.properties.size(); i++) {
+          const PlyProperty& prop = e.properties[i];
+          p = skip_space(p, eol);
+          if (prop.list) {
+            long long n = 0, index = 0;
+            parse_int(p, eol, n);
+            for (long long k = 0; k < n; k++) {
+              p = skip_space(p, eol);
+              parse_int(p, eol, index);
+              if ((int)i == indices) {
+                polygon.push_back(index >= 0 && index < numVertices ? index : -1);
+              }
+            }
+            values.push_back(0);
+          } else {
+            float v = 0;
+            parse_float(p, eol, v);
+            values.push_back(v);
+          }
+        }
+        if (isVertex) {
+          for (int k = 0; k < 3; k++) {
+            out.vertices[r][k] = position[k] >= 0 ? (float)values[position[k]] : 0.0f;
+            if (hasNormals) {
+              out.normals[r][k] = (float)values[normal[k]];
+            }
+          }
+        } else if (isFace) {
+          dropped += !ply_add_polygon(out, polygon);
+        }
+        p = eol;
+      }
+      continue;
+    }
+
+    if (e.stride) {
+      // fixed-size records, decoded in parallel by stride
+      if ((size_t)(end - p) < e.count * e.stride) {
+        std::cerr << filename << ": truncated PLY element " << e.name << std::endl;
+        return false;
+      }
+      if (isVertex) {
+        const char* base = p;
+        parallel_for(e.count, [&](size_t r){
+          const char* record = base + r * e.stride;
+          for (int k = 0; k < 3; k++) {
+            if (position[k] >= 0) {
+              const PlyProperty& prop = e.properties[position[k]];
+              out.vertices[r][k] = (float)ply_read(record + prop.offset, prop.type, swap);
+            }
+            if (hasNormals) {
+              const PlyProperty& prop = e.properties[normal[k]];
+              out.normals[r][k] = (float)ply_read(record + prop.offset, prop.type, swap);
+            }
+          }
+        });
+      }
+      p += e.count * e.stride;
+      continue;
+    }
+
+    // records with lists are walked one by one
+    for (size_t r = 0; r < e.count; r++) {
+      if (!isFace || indices < 0) {
+        p = ply_skip_record(p, end, e, swap);
+        continue;
+      }
+      polygon.clear();
+      for (size_t i = 0; i < e.properties.size() && p < end; i++) {
+        const PlyProperty& prop = e.properties[i];
+        if (!prop.list) {
+          p += ply_size(prop.type);
+          continue;
+        }
+        size_t n = (size_t)ply_read(p, prop.countType, swap);
+        p += ply_size(prop.countType);
+        size_t itemSize = ply_size(prop.type);
+        if ((size_t)(end - p) < n * itemSize) {
+          p = end;
+          break;
+        }
+        if ((int)i == indices) {
+          for (size_t k = 0; k < n; k++) {
+            polygon.push_back(ply_index(ply_read(p + k * itemSize, prop.type, swap), numVertices));
+          }
+        }
+        p += n * itemSize;
+      }
+      dropped += !ply_add_polygon(out, polygon);
+    }
+    if (p > end) {
+      p = end;
+    }
+  }
+  if (dropped > 0) {
+    std::cerr << filename << ": dropped " << dropped << " faces with vertex indices out of range" << std::endl;
+  }
+  return true;
+}
+
+// Binary STL reader. STL stores three unshared corners per facet, so corners
+// with bit-identical positions are welded back into shared vertices.
+namespace {
+
+struct PositionHash
+{
+    size_t operator()(const glm::vec3& p) const {
+      uint32_t bits[3];
+      memcpy(bits, &p, 12);
+      uint64_t h = bits[0] * 0x9E3779B185EBCA87ULL;
+      h = (h ^ bits[1]) * 0xC2B2AE3D27D4EB4FULL;
+      h = (h ^ bits[2]) * 0x9E3779B185EBCA87ULL;
+      return h ^ (h >> 29);
+    }
+};
+
+struct PositionEqual
+{
+    bool operator()(const glm::vec3& a, const glm::vec3& b) const {
+      return memcmp(&a, &b, 12) == 0;
+    }
+};
+
+}
+
+bool read_stl(const std::string& filename, MeshData& out){
+  out.vertices.clear();
+  out.normals.clear();
+  out.triangles.clear();
+
+  MappedFile file(filename);
+  if (!file.data) {
+    std::cerr << "Could not read " << filename << std::endl;
+    return false;
+  }
+  uint32_t numFacets = 0;
+  if (file.size >= 84) {
+    numFacets = (uint32_t)ply_read(file.data + 80, PLY_UINT32, !host_little_endian());
+  }
+  if (file.size < 84 || file.size != 84 + (size_t)numFacets * 50) {
+    std::cerr << filename << ": not a binary STL file" << std::endl;
+    return false;
+  }
+
+  std::unordered_map<glm::vec3, int, PositionHash, PositionEqual> welded;
+  welded.reserve(numFacets);
+  out.triangles.resize(numFacets);
+  bool swap = !host_little_endian();
+  for (uint32_t f = 0; f < numFacets; f++) {
+    // skip the facet normal, it is recomputed from the welded mesh
+    const char* facet = file.data + 84 + (size_t)f * 50 + 12;
+    for (int k = 0; k < 3; k++) {
+      glm::vec3 position;
+      for (int c = 0; c < 3; c++) {
+        // +0.0f folds -0 into 0 so they weld together
+        position[c] = (float)ply_read(facet + 12 * k + 4 * c, PLY_FLOAT32, swap) + 0.0f;
+      }
+      std::pair<std::unordered_map<glm::vec3, int, PositionHash, PositionEqual>::iterator, bool> inserted =
+        welded.insert(std::make_pair(position, (int)out.vertices.size()));
+      if (inserted.second) {
+        out.vertices.push_back(position);
+      }
+      out.triangles[f][k] = inserted.first->second;
+    }
+  }
+  return true;
+}
+
+bool read_mesh(const std::string& filename, MeshData& out){
+  std::string ext = filename.substr(std::min(filename.size(), filename.rfind('.') + 1));
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  if (ext == "ply") {
+    return read_ply(filename, out);
+  }
+  if (ext == "stl") {
+    return read_stl(filename, out);
+  }
+  return read_obj(filename, out);
+}
+
+// Import-time cleanup of triangle soups. Vertices are bucketed in a uniform
+// grid with cells twice the weld tolerance, so every vertex only compares
+// against the 2x2x2 cells nearest to it. Vertices in reach of each other are
+// joined in a union-find, so the clusters are the connected components of
+// the within-tolerance relation and do not depend on the thread count.
+namespace {
+
+struct GridEntry
+{
+    uint64_t key;
+    uint32_t vertex;
+};
+
+struct GridCell
+{
+    uint64_t key;
+    uint32_t begin;
+    uint32_t end;
+};
+
+const uint64_t emptyCell = ~0ULL;
+
+inline uint64_t cell_key(int64_t x, int64_t y, int64_t z){
+  const uint64_t mask = (1 << 21) - 1;
+  return ((uint64_t)x & mask) | (((uint64_t)y & mask) << 21) | (((uint64_t)z & mask) << 42);
+}
+
+inline size_t cell_slot(uint64_t key, size_t mask){
+  return (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 20) & mask;
+}
+
+// Lock-free union-find. Parents always have lower indices than their
+// children, so every root is the lowest vertex of its set whatever order
+// the unions run in, and path halving only ever moves a link to an ancestor.
+uint32_t find_root(std::vector<std::atomic<uint32_t>>& parent, uint32_t v){
+  uint32_t p = parent[v].load(std::memory_order_relaxed);
+  while (p != v) {
+    uint32_t grand = parent[p].load(std::memory_order_relaxed);
+    parent[v].store(grand, std::memory_order_relaxed);
+    v = grand;
+    p = parent[v].load(std::memory_order_relaxed);
+  }
+  return v;
+}
+
+void unite(std::vector<std::atomic<uint32_t>>& parent, uint32_t a, uint32_t b){
+  while (true) {
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a == b) {
+      return;
+    }
+    if (a < b) {
+      std::swap(a, b);
+    }
+    // hang the higher root under the lower one, unless it stopped being a root
+    uint32_t expected = a;
+    if (parent[a].compare_exchange_weak(expected, b, std::memory_order_relaxed)) {
+      return;
+    }
+  }
+}
+
+}
+
+WeldStats weld(MeshData& data, float tolerance){
+  WeldStats stats;
+  size_t n = data.vertices.size();
+  if (n == 0) {
+    return stats;
+  }
+
+  // grid over the bounding box
+  glm::vec3 lo = data.vertices[0], hi = data.vertices[0];
+  for (const glm::vec3& p : data.vertices) {
+    lo = glm::min(lo, p);
+    hi = glm::max(hi, p);
+  }
+  float extent = std::max(hi.x - lo.x, std::max(hi.y - lo.y, hi.z - lo.z));
+  float cellSize = tolerance > 0 ? 2 * tolerance : (extent > 0 ? extent / 1024 : 1.0f);
+  float tolerance2 = tolerance * tolerance;
+  std::vector<GridEntry> entries(n), scratch;
+  parallel_for(n, [&](size_t v){
+    glm::vec3 c = glm::floor((data.vertices[v] - lo) / cellSize);
+    entries[v].key = cell_key((int64_t)c.x, (int64_t)c.y, (int64_t)c.z);
+    entries[v].vertex = v;
+  });
+  radix_sort(entries, scratch, 63, [](const GridEntry& e){ return e.key; });
+  std::vector<GridEntry>().swap(scratch);
+
+  // open-addressing table from cell key to its run of sorted entries
+  size_t numCells = 1;
+  for (size_t i = 1; i < n; i++) {
+    numCells += entries[i].key != entries[i - 1].key;
+  }
+  size_t tableSize = 1;
+  while (tableSize < 2 * numCells) {
+    tableSize <<= 1;
+  }
+  std::vector<GridCell> table(tableSize);
+  for (GridCell& c : table) {
+    c.key = emptyCell;
+  }
+  for (size_t i = 0; i < n;) {
+    size_t j = i + 1;
+    while (j < n && entries[j].key == entries[i].key) {
+      j++;
+    }
+    size_t slot = cell_slot(entries[i].key, tableSize - 1);
+    while (table[slot].key != emptyCell) {
+      slot = (slot + 1) & (tableSize - 1);
+    }
+    table[slot].key = entries[i].key;
+    table[slot].begin = i;
+    table[slot].end = j;
+    i = j;
+  }
+
+  // join every vertex with the lower-indexed ones within the tolerance
+  std::vector<std::atomic<uint32_t>> parent(n);
+  parallel_for(n, [&](size_t v){
+    parent[v].store(v, std::memory_order_relaxed);
+  });
+  parallel_for(n, [&](size_t v){
+    const glm::vec3& p = data.vertices[v];
+    glm::vec3 g = (p - lo) / cellSize;
+    glm::vec3 c = glm::floor(g);
+    // anything within the tolerance lies in this cell or the neighbour on
+    // the side of the nearer face, along each axis
+    int step[3];
+    for (int k = 0; k < 3; k++) {
+      step[k] = g[k] - c[k] < 0.5f ? -1 : 1;
+    }
+    for (int dz = 0; dz < 2; dz++) {
+      for (int dy = 0; dy < 2; dy++) {
+        for (int dx = 0; dx < 2; dx++) {
+          uint64_t key = cell_key((int64_t)c.x + dx * step[0], (int64_t)c.y + dy * step[1], (int64_t)c.z + dz * step[2]);
+          size_t slot = cell_slot(key, tableSize - 1);
+          while (table[slot].key != emptyCell && table[slot].key != key) {
+            slot = (slot + 1) & (tableSize - 1);
+          }
+          if (table[slot].key == emptyCell) {
+            continue;
+          }
+          // runs are sorted by vertex index, every pair is seen from its higher end
+          for (uint32_t i = table[slot].begin; i < table[slot].end && entries[i].vertex < v; i++) {
+            glm::vec3 d = data.vertices[entries[i].vertex] - p;
+            if (glm::dot(d, d) <= tolerance2) {
+              unite(parent, v, entries[i].vertex);
+            }
+          }
+        }
+      }
+    }
+  });
+  std::vector<GridEntry>().swap(entries);
+  std::vector<GridCell>().swap(table);
+  std::vector<uint32_t> root(n);
+  parallel_for(n, [&](size_t v){
+    root[v] = find_root(parent, v);
+  });
+  std::vector<std::atomic<uint32_t>>().swap(parent);
+
+  // roots are the lowest vertex of their cluster, so one ascending pass
+  // numbers them in order
+  std::vector<uint32_t> remap(n);
+  uint32_t kept = 0;
+  for (size_t v = 0; v < n; v++) {
+    remap[v] = root[v] == v ? kept++ : remap[root[v]];
+  }
+  stats.mergedVertices = n - kept;
+  std::vector<glm::vec3> vertices(kept), normals(data.normals.size() >= n ? kept : 0);
+  parallel_for(n, [&](size_t v){
+    if (root[v] == v) {
+      vertices[remap[v]] = data.vertices[v];
+      if (!normals.empty()) {
+        normals[remap[v]] = data.normals[v];
+      }
+    }
+  });
+  data.vertices.swap(vertices);
+  data.normals.swap(normals);
+
+  // remap triangles and flag zero-area ones
+  size_t numTriangles = data.triangles.size();
+  std::vector<uint8_t> drop(numTriangles, 0);
+  parallel_for(numTriangles, [&](size_t t){
+    glm::ivec3& tri = data.triangles[t];
+    for (int k = 0; k < 3; k++) {
+      if (tri[k] < 0 || (size_t)tri[k] >= n) {
+        drop[t] = 1;
+        return;
+      }
+      tri[k] = remap[tri[k]];
+    }
+    if (tri.x == tri.y || tri.y == tri.z || tri.z == tri.x) {
+      drop[t] = 1;
+      return;
+    }
+    glm::vec3 e0 = data.vertices[tri.y] - data.vertices[tri.x];
+    glm::vec3 e1 = data.vertices[tri.z] - data.vertices[tri.x];
+    glm::vec3 e2 = data.vertices[tri.z] - data.vertices[tri.y];
+    double cross2 = glm::dot(glm::cross(e0, e1), glm::cross(e0, e1));
+    double edge2 = std::max(glm::dot(e0, e0), std::max(glm::dot(e1, e1), glm::dot(e2, e2)));
+    if (cross2 <= 1e-14 * edge2 * edge2) {
+      drop[t] = 1;
+    }
+  });
+
+  // duplicates share their smallest vertex, so group by it and compare the
+  // other two corners; the lowest-indexed copy survives
+  std::vector<GridEntry> byCorner;
+  byCorner.reserve(numTriangles);
+  for (size_t t = 0; t < numTriangles; t++) {
+    if (!drop[t]) {
+      const glm::ivec3& tri = data.triangles[t];
+      GridEntry e;
+      e.key = std::min(tri.x, std::min(tri.y, tri.z));
+      e.vertex = t;
+      byCorner.push_back(e);
+    }
+  }
+  int bits = 0;
+  while (bits < 32 && (kept >> bits) != 0) {
+    bits++;
+  }
+  radix_sort(byCorner, scratch, bits, [](const GridEntry& e){ return e.key; });
+  size_t m = byCorner.size();
+  size_t blocks = std::max<size_t>(1, std::min<size_t>(num_threads(), m / 65536));
+  parallel_for(blocks, [&](size_t b){
+    size_t i = m * b / blocks;
+    size_t stop = m * (b + 1) / blocks;
+    while (i > 0 && i < stop && byCorner[i].key == byCorner[i - 1].key) {
+      i++;
+    }
+    while (i < stop) {
+      size_t j = i + 1;
+      while (j < m && byCorner[j].key == byCorner[i].key) {
+        j++;
+      }
+      for (size_t x = i + 1; x < j; x++) {
+        glm::ivec3 a = data.triangles[byCorner[x].vertex];
+        int a0 = a.x + a.y + a.z - (int)byCorner[x].key;
+        int a1 = std::max(a.x, std::max(a.y, a.z));
+        for (size_t y = i; y < x; y++) {
+          glm::ivec3 c = data.triangles[byCorner[y].vertex];
+          if (drop[byCorner[y].vertex]) {
+            continue;
+          }
+          if (c.x + c.y + c.z - (int)byCorner[y].key == a0 && std::max(c.x, std::max(c.y, c.z)) == a1) {
+            drop[byCorner[x].vertex] = 1;
+            break;
+          }
+        }
+      }
+      i = j;
+    }
+  });
+
+  size_t out = 0;
+  for (size_t t = 0; t < numTriangles; t++) {
+    if (!drop[t]) {
+      data.triangles[out++] = data.triangles[t];
+    }
+  }
+  data.triangles.resize(out);
+  stats.droppedFaces = numTriangles - out;
+  return stats;
+}
+
+// Binary half-edge format, version 3. All fields are little-endian.
+//
+//   BinaryHeader                      256 bytes
+//   arrays[0]  glm::vec3 positions    per vertex
+//   arrays[1]  glm::vec3 normals      per vertex
+//   arrays[2]  Index halfEdge         per vertex
+//   arrays[3]  HalfEdge<Index>        per half-edge, three per face
+//
+// Each array is described by its offset, element count and element size,
+// starts on a 64-byte boundary and includes the dummy element 0, so it can
+// be used in place. The index width is the element size of arrays[2]. The
+// checksum covers everything after the header.
+namespace {
+
+const char binaryMagic[8] = {'H', 'E', 'M', 'E', 'S', 'H', '\r', '\n'};
+const uint32_t binaryVersion = 3;
+const uint32_t byteOrderMark = 0x01020304;
+const uint32_t binaryArrays = 4;
+
+struct BinaryArray
+{
+    uint64_t offset;
+    uint64_t count;
+    uint32_t elementSize;
+    uint32_t reserved;
+};
+
+struct BinaryHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t numArrays;
+    uint32_t reserved;
+    uint64_t fileSize;
+    uint64_t checksum;
+    BinaryArray arrays[8];
+    uint8_t padding[24];
+};
+static_assert(sizeof(BinaryHeader) == 256, "BinaryHeader must stay 256 bytes");
+
+inline uint64_t align64(uint64_t offset){
+  return (offset + 63) & ~(uint64_t)63;
+}
+
+inline uint64_t rotl(uint64_t x, int r){
+  return (x << r) | (x >> (64 - r));
+}
+
+// 64-bit checksum over 32-byte stripes with four independent lanes
+uint64_t checksum(const char* data, size_t size){
+  const uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+  const uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+  uint64_t lane[4] = {prime1, prime2, ~prime1, ~prime2};
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    for (int k = 0; k < 4; k++) {
+      uint64_t w;
+      memcpy(&w, data + i + 8 * k, 8);
+      lane[k] = rotl(lane[k] + w * prime2, 31) * prime1;
+    }
+  }
+  uint64_t h = rotl(lane[0], 1) + rotl(lane[1], 7) + rotl(lane[2], 12) + rotl(lane[3], 18);
+  for (; i < size; i++) {
+    h = rotl(h ^ ((uint8_t)data[i] * prime1), 11) * prime2;
+  }
+  h ^= size;
+  h ^= h >> 33;
+  h *= prime2;
+  h ^= h >> 29;
+  return h;
+}
+
+// Points buffer at (view) or copies one array of a validated mapped file
+template <class T>
+void load_array(Buffer<T>& buffer, const BinaryArray& array, const std::shared_ptr<MappedFile>& file, bool view){
+  T* data = reinterpret_cast<T*>(file->data + array.offset);
+  if (view) {
+    buffer.borrow(data, array.count, file);
+  } else {
+    buffer.resize(array.count);
+    memcpy(buffer.data(), data, array.count * sizeof(T));
+  }
+}
+
+}
+
+template <class Index>
+bool BasicMesh<Index>::save_binary(const std::string& filename){
+  if (!this->freeVertices.empty() || !this->freeFaces.empty()) {
+    compact();
+  }
+  if (!host_little_endian()) {
+    std::cerr << "Binary meshes can only be written on little-endian hosts" << std::endl;
+    return false;
+  }
+  const void* data[binaryArrays] = {
+    this->positions.data(), this->normals.data(), this->vertexHalfEdges.data(), this->halfEdges.data()
+  };
+  uint64_t counts[binaryArrays] = {
+    this->positions.size(), this->normals.size(), this->vertexHalfEdges.size(), this->halfEdges.size()
+  };
+  uint32_t sizes[binaryArrays] = {
+    sizeof(glm::vec3), sizeof(glm::vec3), sizeof(Index), sizeof(HalfEdge<Index>)
+  };
+
+  BinaryHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, binaryMagic, sizeof(binaryMagic));
+  header.version = binaryVersion;
+  header.byteOrder = byteOrderMark;
+  header.numArrays = binaryArrays;
+  uint64_t offset = sizeof(BinaryHeader);
+  for (uint32_t i = 0; i < binaryArrays; i++) {
+    header.arrays[i].offset = align64(offset);
+    header.arrays[i].count = counts[i];
+    header.arrays[i].elementSize = sizes[i];
+    offset = header.arrays[i].offset + counts[i] * sizes[i];
+  }
+  header.fileSize = offset;
+
+  // lay the payload out in memory once so the checksum and write share it
+  std::vector<char> payload(header.fileSize - sizeof(BinaryHeader), 0);
+  char* base = payload.data() - sizeof(BinaryHeader);
+  for (uint32_t i = 0; i < binaryArrays; i++) {
+    memcpy(base + header.arrays[i].offset, data[i], counts[i] * sizes[i]);
+  }
+  header.checksum = checksum(payload.data(), payload.size());
+
+  std::ofstream f(filename, std::ios::binary);
+  f.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  f.write(payload.data(), payload.size());
+  if (!f) {
+    std::cerr << "Could not write " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+template <class Index>
+bool BasicMesh<Index>::load_binary(const std::string& filename, bool view, bool verify){
+  std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(filename, view);
+  if (!file->data) {
+    std::cerr << "Could not read " << filename << std::endl;
+    return false;
+  }
+  BinaryHeader header;
+  if (file->size < sizeof(header)) {
+    std::cerr << filename << ": not a binary mesh" << std::endl;
+    return false;
+  }
+  memcpy(&header, file->data, sizeof(header));
+  if (memcmp(header.magic, binaryMagic, sizeof(binaryMagic)) != 0) {
+    std::cerr << filename << ": not a binary mesh" << std::endl;
+    return false;
+  }
+  uint32_t sizes[binaryArrays] = {
+    sizeof(glm::vec3), sizeof(glm::vec3), sizeof(Index), sizeof(HalfEdge<Index>)
+  };
+  bool layout = header.version == binaryVersion && header.byteOrder == byteOrderMark && header.numArrays == binaryArrays;
+  if (layout && header.arrays[2].elementSize != sizeof(Index)) {
+    std::cerr << filename << ": stored with " << 8 * header.arrays[2].elementSize << "-bit indices, not " << 8 * sizeof(Index) << std::endl;
+    return false;
+  }
+  for (uint32_t i = 0; layout && i < binaryArrays; i++) {
+    layout = header.arrays[i].elementSize == sizes[i];
+  }
+  if (!layout) {
+    std::cerr << filename << ": unsupported binary mesh version or layout" << std::endl;
+    return false;
+  }
+  // an empty mesh has empty arrays, a mesh without faces no half-edges
+  bool valid = header.fileSize == file->size &&
+    header.arrays[0].count == header.arrays[1].count && header.arrays[0].count == header.arrays[2].count &&
+    (header.arrays[3].count == 0 || header.arrays[3].count % 3 == 1);
+  for (uint32_t i = 0; valid && i < binaryArrays; i++) {
+    const BinaryArray& array = header.arrays[i];
+    valid = array.offset % 64 == 0 && array.offset >= sizeof(header) && array.offset <= header.fileSize &&
+      array.count <= (header.fileSize - array.offset) / array.elementSize;
+  }
+  if (!valid) {
+    std::cerr << filename << ": truncated binary mesh" << std::endl;
+    return false;
+  }
+  if (verify && checksum(file->data + sizeof(header), file->size - sizeof(header)) != header.checksum) {
+    std::cerr << filename << ": checksum mismatch" << std::endl;
+    return false;
+  }
+
+  freeArrays();
+  load_array(this->positions, header.arrays[0], file, view);
+  load_array(this->normals, header.arrays[1], file, view);
+  load_array(this->vertexHalfEdges, header.arrays[2], file, view);
+  load_array(this->halfEdges, header.arrays[3], file, view);
+
+  // The checksum only catches damage, so the connectivity is checked before
+  // a ring walk can follow it out of bounds: heads and pairs in range,
+  // pairs mutual and reversed, deleted faces fully cleared, and every
+  // vertex's half-edge leaving it, 0 or deletedIndex. The tombstones refill
+  // the free lists.
+  size_t numVertices = this->positions.size();
+  size_t numHalfEdges = this->halfEdges.size();
+  size_t numFaces = num_faces();
+  const size_t block = 65536;
+  size_t vertexBlocks = (numVertices + block - 1) / block;
+  size_t faceBlocks = (numFaces + block) / block;
+  std::vector<char> broken(vertexBlocks + faceBlocks, 0);
+  std::vector<std::vector<Index>> deletedVertices(vertexBlocks);
+  std::vector<std::vector<Index>> deletedFaces(faceBlocks);
+  parallel_for(vertexBlocks + faceBlocks, [&](size_t b){
+    if (b < vertexBlocks) {
+      size_t last = std::min(numVertices, (b + 1) * block);
+      for (size_t v = std::max<size_t>(b * block, 1); v < last; v++) {
+        Index he = this->vertexHalfEdges[v];
+        if (he == deletedIndex) {
+          deletedVertices[b].push_back(v);
+        } else if (he != 0 && (he >= numHalfEdges || this->halfEdges[he].head != v)) {
+          broken[b] = 1;
+        }
+      }
+      return;
+    }
+    size_t c = b - vertexBlocks;
+    size_t last = std::min(numFaces + 1, (c + 1) * block);
+    for (size_t f = std::max<size_t>(c * block, 1); f < last; f++) {
+      size_t first = 3 * f - 2;
+      int cleared = 0;
+      for (size_t k = 0; k < 3; k++) {
+        const HalfEdge<Index>& e = this->halfEdges[first + k];
+        if (e.head == 0) {
+          cleared++;
+          broken[b] |= e.pair != 0;
+        } else if (e.head >= numVertices || e.pair >= numHalfEdges) {
+          broken[b] = 1;
+        } else if (e.pair != 0) {
+          const HalfEdge<Index>& pair = this->halfEdges[e.pair];
+          broken[b] |= pair.pair != first + k || pair.head != this->halfEdges[first + (k + 1) % 3].head;
+        }
+      }
+      if (cleared == 3) {
+        deletedFaces[c].push_back(f);
+      } else {
+        broken[b] |= cleared != 0;
+      }
+    }
+  });
+  if (std::find(broken.begin(), broken.end(), 1) != broken.end()) {
+    freeArrays();
+    std::cerr << filename << ": invalid connectivity in binary mesh" << std::endl;
+    return false;
+  }
+  for (const std::vector<Index>& vertices : deletedVertices) {
+    this->freeVertices.insert(this->freeVertices.end(), vertices.begin(), vertices.end());
+  }
+  for (const std::vector<Index>& faces : deletedFaces) {
+    this->freeFaces.insert(this->freeFaces.end(), faces.begin(), faces.end());
+  }
+  return true;
+}
+
+// Text and binary exporters. Output is assembled in a large buffer that is
+// handed to the stream in big blocks instead of per line.
+namespace {
+
+class OutputFile
+{
+  public:
+    OutputFile(const std::string& filename) : f(filename, std::ios::binary), buffer(1 << 22){}
+
+    // Returns space for at least n bytes, advance it with commit()
+    char* reserve(size_t n){
+      if (this->used + n > this->buffer.size()) {
+        flush();
+        if (n > this->buffer.size()) {
+          this->buffer.resize(n);
+        }
+      }
+      return this->buffer.data() + this->used;
+    }
+    void commit(char* end){
+      this->used = end - this->buffer.data();
+    }
+    void write(const void* data, size_t n){
+      char* out = reserve(n);
+      memcpy(out, data, n);
+      commit(out + n);
+    }
+    bool close(){
+      flush();
+      this->f.close();
+      return !this->f.fail();
+    }
+
+  private:
+    std::ofstream f;
+    std::vector<char> buffer;
+    size_t used = 0;
+
+    void flush(){
+      this->f.write(this->buffer.data(), this->used);
+      this->used = 0;
+    }
+};
+
+char* write_uint(char* out, uint64_t v){
+  char digits[20];
+  int n = 0;
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (n) {
+    *out++ = digits[--n];
+  }
+  return out;
+}
+
+// 128-bit unsigned integer for building the Ryu tables
+struct Wide
+{
+    uint64_t hi;
+    uint64_t lo;
+
+    void times5(){
+      uint64_t lo4 = this->lo << 2;
+      uint64_t sum = lo4 + this->lo;
+      this->hi = (this->hi << 2) + this->hi + (this->lo >> 62) + (sum < lo4);
+      this->lo = sum;
+    }
+    // low 64 bits of this >> shift
+    uint64_t shifted(int shift) const {
+      if (shift == 0) {
+        return this->lo;
+      }
+      return shift < 64 ? (this->lo >> shift) | (this->hi << (64 - shift)) : this->hi >> (shift - 64);
+    }
+};
+
+// Bits of 5^e for e > 0, 1 for e == 0
+inline int pow5bits(int e){
+  return (int)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+// Multipliers of Ryu's float conversion (Adams, "Ryu: fast float-to-string
+// conversion"): the top 61 bits of 5^i, and 2^(pow5bits(i) + 58) / 5^i
+// rounded up. They are computed once instead of stored.
+struct RyuTables
+{
+    uint64_t pow5[48];
+    uint64_t pow5Inv[31];
+
+    RyuTables(){
+      Wide p = {0, 1};
+      for (int i = 0; i < 48; i++) {
+        int shift = pow5bits(i) - 61;
+        this->pow5[i] = shift >= 0 ? p.shifted(shift) : p.lo << -shift;
+        if (i < 31) {
+          // restoring division of 2^n by p, the quotient is below 2^60
+          int n = pow5bits(i) + 58;
+          Wide r = {0, 0};
+          uint64_t q = 0;
+          for (int b = n; b >= 0; b--) {
+            r.hi = (r.hi << 1) | (r.lo >> 63);
+            r.lo = (r.lo << 1) | (b == n ? 1 : 0);
+            if (r.hi > p.hi || (r.hi == p.hi && r.lo >= p.lo)) {
+              r.hi = r.hi - p.hi - (r.lo < p.lo);
+              r.lo -= p.lo;
+              q |= 1ULL << b;
+            }
+          }
+          this->pow5Inv[i] = q + 1;
+        }
+        p.times5();
+      }
+    }
+};
+
+// (m * factor) >> shift for shift > 32
+inline uint32_t mul_shift(uint32_t m, uint64_t factor, int shift){
+  uint64_t low = (uint64_t)m * (uint32_t)factor;
+  uint64_t high = (uint64_t)m * (factor >> 32);
+  return (uint32_t)(((low >> 32) + high) >> (shift - 32));
+}
+
+inline bool multiple_of_pow5(uint32_t value, uint32_t p){
+  uint32_t count = 0;
+  while (value % 5 == 0 && count < p) {
+    value /= 5;
+    count++;
+  }
+  return count >= p;
+}
+
+// Shortest decimal output * 10^exponent that reads back as the positive
+// finite float with the given bits, the closest one if there are several
+// (Ryu's f2s)
+void shortest_decimal(uint32_t bits, uint32_t& output, int& exponent){
+  static const RyuTables tables;
+  uint32_t ieeeMantissa = bits & ((1u << 23) - 1);
+  uint32_t ieeeExponent = bits >> 23;
+  int e2 = (ieeeExponent == 0 ? 1 : (int)ieeeExponent) - 127 - 23 - 2;
+  uint32_t m2 = ieeeExponent == 0 ? ieeeMantissa : (1u << 23) | ieeeMantissa;
+  bool acceptBounds = (m2 & 1) == 0;
+  // the value and the halfway points to its neighbours, times 4
+  uint32_t mv = 4 * m2;
+  uint32_t mp = 4 * m2 + 2;
+  uint32_t mmShift = ieeeMantissa != 0 || ieeeExponent <= 1;
+  uint32_t mm = 4 * m2 - 1 - mmShift;
+
+  uint32_t vr, vp, vm;
+  int e10;
+  bool vmTrailingZeros = false;
+  bool vrTrailingZeros = false;
+  uint32_t lastRemovedDigit = 0;
+  if (e2 >= 0) {
+    uint32_t q = ((uint32_t)e2 * 78913) >> 18;
+    e10 = q;
+    int i = -e2 + (int)q + 58 + pow5bits(q);
+    vr = mul_shift(mv, tables.pow5Inv[q], i);
+    vp = mul_shift(mp, tables.pow5Inv[q], i);
+    vm = mul_shift(mm, tables.pow5Inv[q], i);
+    if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+      int l = -e2 + (int)q - 1 + 58 + pow5bits(q - 1);
+      lastRemovedDigit = mul_shift(mv, tables.pow5Inv[q - 1], l) % 10;
+    }
+    if (q <= 9) {
+      if (mv % 5 == 0) {
+        vrTrailingZeros = multiple_of_pow5(mv, q);
+      } else if (acceptBounds) {
+        vmTrailingZeros = multiple_of_pow5(mm, q);
+      } else {
+        vp -= multiple_of_pow5(mp, q);
+      }
+    }
+  } else {
+    uint32_t q = ((uint32_t)-e2 * 732923) >> 20;
+    e10 = (int)q + e2;
+    int i = -e2 - (int)q;
+    int j = (int)q - (pow5bits(i) - 61);
+    vr = mul_shift(mv, tables.pow5[i], j);
+    vp = mul_shift(mp, tables.pow5[i], j);
+    vm = mul_shift(mm, tables.pow5[i], j);
+    if (q != 0 && (vp - 1) / 10 <= vm / 10) {
+      j = (int)q - 1 - (pow5bits(i + 1) - 61);
+      lastRemovedDigit = mul_shift(mv, tables.pow5[i + 1], j) % 10;
+    }
+    if (q <= 1) {
+      vrTrailingZeros = true;
+      if (acceptBounds) {
+        vmTrailingZeros = mmShift == 1;
+      } else {
+        vp--;
+      }
+    } else if (q < 31) {
+      vrTrailingZeros = (mv & ((1u << (q - 1)) - 1)) == 0;
+    }
+  }
+
+  // drop digits while the interval still holds a shorter number
+  int removed = 0;
+  if (vmTrailingZeros || vrTrailingZeros) {
+    while (vp / 10 > vm / 10) {
+      vmTrailingZeros &= vm % 10 == 0;
+      vrTrailingZeros &= lastRemovedDigit == 0;
+      lastRemovedDigit = vr % 10;
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      removed++;
+    }
+    if (vmTrailingZeros) {
+      while (vm % 10 == 0) {
+        vrTrailingZeros &= lastRemovedDigit == 0;
+        lastRemovedDigit = vr % 10;
+        vr /= 10;
+        vp /= 10;
+        vm /= 10;
+        removed++;
+      }
+    }
+    // an exact tie rounds to even
+    if (vrTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0) {
+      lastRemovedDigit = 4;
+    }
+    output = vr + ((vr == vm && (!acceptBounds || !vmTrailingZeros)) || lastRemovedDigit >= 5);
+  } else {
+    while (vp / 10 > vm / 10) {
+      lastRemovedDigit = vr % 10;
+      vr /= 10;
+      vp /= 10;
+      vm /= 10;
+      removed++;
+    }
+    output = vr + (vr == vm || lastRemovedDigit >= 5);
+  }
+  exponent = e10 + removed;
+}
+
+// Writes v with the fewest significant digits that read back as the same
+// float under correct rounding. Very large or small magnitudes use an
+// exponent. Writes at most 16 characters.
+char* write_float(char* out, float v){
+  uint32_t bits;
+  memcpy(&bits, &v, 4);
+  if ((bits & 0x7f800000u) == 0x7f800000u && (bits & 0x007fffffu) != 0) {
+    memcpy(out, "nan", 3);
+    return out + 3;
+  }
+  if (bits >> 31) {
+    *out++ = '-';
+    bits &= 0x7fffffffu;
+  }
+  if (bits == 0) {
+    *out++ = '0';
+    return out;
+  }
+  if (bits == 0x7f800000u) {
+    memcpy(out, "inf", 3);
+    return out + 3;
+  }
+  static const uint32_t pow10[] = {
+    1u, 10u, 100u, 1000u, 10000u, 100000u, 1000000u, 10000000u, 100000000u
+  };
+  uint32_t mantissa;
+  int exponent;
+  shortest_decimal(bits, mantissa, exponent);
+  int numDigits = 1;
+  while (numDigits < 9 && mantissa >= pow10[numDigits]) {
+    numDigits++;
+  }
+  // exponent of the first digit
+  exponent += numDigits - 1;
+  char digits[9];
+  for (int i = numDigits - 1; i >= 0; i--) {
+    digits[i] = '0' + mantissa % 10;
+    mantissa /= 10;
+  }
+  while (numDigits > 1 && digits[numDigits - 1] == '0') {
+    numDigits--;
+  }
+  if (exponent >= -5 && exponent < 9) {
+    if (exponent < 0) {
+      *out++ = '0';
+      *out++ = '.';
+      for (int i = -1; i > exponent; i--) {
+        *out++ = '0';
+      }
+      memcpy(out, digits, numDigits);
+      return out + numDigits;
+    }
+    for (int i = 0; i <= exponent; i++) {
+      *out++ = i < numDigits ? digits[i] : '0';
+    }
+    if (numDigits > exponent + 1) {
+      *out++ = '.';
+      memcpy(out, digits + exponent + 1, numDigits - exponent - 1);
+      out += numDigits - exponent - 1;
+    }
+    return out;
+  }
+  *out++ = digits[0];
+  if (numDigits > 1) {
+    *out++ = '.';
+    memcpy(out, digits + 1, numDigits - 1);
+    out += numDigits - 1;
+  }
+  *out++ = 'e';
+  if (exponent < 0) {
+    *out++ = '-';
+    exponent = -exponent;
+  }
+  return write_uint(out, exponent);
+}
+
+}
+
+template <class Index>
+bool BasicMesh<Index>::save_obj(const std::string& filename){
+  if (!this->freeVertices.empty() || !this->freeFaces.empty()) {
+    compact();
+  }
+  OutputFile f(filename);
+  for (size_t i = 1; i < this->positions.size(); i++) {
+    const glm::vec3& p = this->positions[i];
+    char* out = f.reserve(64);
+    *out++ = 'v';
+    for (int k = 0; k < 3; k++) {
+      *out++ = ' ';
+      out = write_float(out, p[k]);
+    }
+    *out++ = '\n';
+    f.commit(out);
+  }
+  for (size_t i = 1; i < this->normals.size(); i++) {
+    const glm::vec3& n = this->normals[i];
+    char* out = f.reserve(64);
+    *out++ = 'v';
+    *out++ = 'n';
+    for (int k = 0; k < 3; k++) {
+      *out++ = ' ';
+      out = write_float(out, n[k]);
+    }
+    *out++ = '\n';
+    f.commit(out);
+  }
+  for (size_t i = 1; i <= num_faces(); i++) {
+    Index he = face_halfEdge(i);
+    uint64_t corners[3] = {edge_head(he), edge_head(edge_next(he)), edge_head(edge_prev(he))};
+    char* out = f.reserve(80);
+    *out++ = 'f';
+    for (int k = 0; k < 3; k++) {
+      *out++ = ' ';
+      out = write_uint(out, corners[k]);
+      *out++ = '/';
+      *out++ = '/';
+      out = write_uint(out, corners[k]);
+    }
+    *out++ = '\n';
+    f.commit(out);
+  }
+  if (!f.close()) {
+    std::cerr << "Could not write " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+template <class Index>
+bool BasicMesh<Index>::save_ply(const std::string& filename){
+  if (!this->freeVertices.empty() || !this->freeFaces.empty()) {
+    compact();
+  }
+  if (!host_little_endian()) {
+    std::cerr << "Binary PLY can only be written on little-endian hosts" << std::endl;
+    return false;
+  }
+  size_t numVertices = this->positions.empty() ? 0 : this->positions.size() - 1;
+  if (numVertices > std::numeric_limits<uint32_t>::max()) {
+    std::cerr << filename << ": " << numVertices << " vertices do not fit 32-bit PLY indices" << std::endl;
+    return false;
+  }
+  OutputFile f(filename);
+  std::string header =
+    "ply\n"
+    "format binary_little_endian 1.0\n"
+    "element vertex " + std::to_string(numVertices) + "\n"
+    "property float x\n"
+    "property float y\n"
+    "property float z\n"
+    "property float nx\n"
+    "property float ny\n"
+    "property float nz\n"
+    "element face " + std::to_string(num_faces()) + "\n"
+    "property list uchar uint vertex_indices\n"
+    "end_header\n";
+  f.write(header.data(), header.size());
+  for (size_t i = 1; i < this->positions.size(); i++) {
+    char* out = f.reserve(24);
+    memcpy(out, &this->positions[i], 12);
+    memcpy(out + 12, &this->normals[i], 12);
+    f.commit(out + 24);
+  }
+  for (size_t i = 1; i <= num_faces(); i++) {
+    Index he = face_halfEdge(i);
+    uint32_t corners[3] = {(uint32_t)(edge_head(he) - 1), (uint32_t)(edge_head(edge_next(he)) - 1), (uint32_t)(edge_head(edge_prev(he)) - 1)};
+    char* out = f.reserve(13);
+    *out = 3;
+    memcpy(out + 1, corners, 12);
+    f.commit(out + 13);
+  }
+  if (!f.close()) {
+    std::cerr << "Could not write " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+template <class Index>
+bool BasicMesh<Index>::save_stl(const std::string& filename){
+  if (!this->freeVertices.empty() || !this->freeFaces.empty()) {
+    compact();
+  }
+  if (!host_little_endian()) {
+    std::cerr << "Binary STL can only be written on little-endian hosts" << std::endl;
+    return false;
+  }
+  if ((size_t)num_faces() > std::numeric_limits<uint32_t>::max()) {
+    std::cerr << filename << ": " << num_faces() << " faces do not fit the 32-bit STL face count" << std::endl;
+    return false;
+  }
+  OutputFile f(filename);
+  char header[80] = "binary STL";
+  f.write(header, sizeof(header));
+  uint32_t numTriangles = num_faces();
+  f.write(&numTriangles, 4);
+  for (size_t i = 1; i <= num_faces(); i++) {
+    Index he = face_halfEdge(i);
+    const glm::vec3& p0 = this->positions[edge_head(he)];
+    const glm::vec3& p1 = this->positions[edge_head(edge_next(he))];
+    const glm::vec3& p2 = this->positions[edge_head(edge_prev(he))];
+    glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+    float len = glm::length(normal);
+    if (len > 0) {
+      normal /= len;
+    }
+    char* out = f.reserve(50);
+    memcpy(out, &normal, 12);
+    memcpy(out + 12, &p0, 12);
+    memcpy(out + 24, &p1, 12);
+    memcpy(out + 36, &p2, 12);
+    out[48] = 0;
+    out[49] = 0;
+    f.commit(out + 50);
+  }
+  if (!f.close()) {
+    std::cerr << "Could not write " << filename << std::endl;
+    return false;
+  }
+  return true;
+}
+
+#define INSTANTIATE_MESH_IO(Index) \
+  template bool BasicMesh<Index>::save_binary(const std::string&); \
+  template bool BasicMesh<Index>::load_binary(const std::string&, bool, bool); \
+  template bool BasicMesh<Index>::save_obj(const std::string&); \
+  template bool BasicMesh<Index>::save_ply(const std::string&); \
+  template bool BasicMesh<Index>::save_stl(const std::string&);
+
+INSTANTIATE_MESH_IO(uint16_t)
+INSTANTIATE_MESH_IO(uint32_t)
+INSTANTIATE_MESH_IO(uint64_t)
@@ -0,0 +1,54 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+// Memory mapping of a whole file. A writable mapping is private, so writes
+// stay in memory and never reach the file.
+class MappedFile
+{
+  public:
+    MappedFile(const std::string& filename, bool writable = false);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    char* data = nullptr;
+    size_t size = 0;
+};
+
+// Raw triangle soup as read from disk, in the form Mesh::init takes
+struct MeshData
+{
+    std::vector<glm::vec3> vertices;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::ivec3> triangles;
+};
+
+// Reads a Wavefront OBJ file. Faces may use the v, v/vt, v//vn and v/vt/vn
+// forms with positive or negative (relative) indices; polygons are fan
+// triangulated. Returns false if the file could not be read.
+bool read_obj(const std::string& filename, MeshData& out);
+
+// Reads an ascii or binary (either endianness) PLY file. Vertex positions
+// and normals are taken from x/y/z and nx/ny/nz in any property order, other
+// properties are skipped. Polygons are fan triangulated.
+bool read_ply(const std::string& filename, MeshData& out);
+
+// Reads a binary STL file, welding corners with identical positions
+bool read_stl(const std::string& filename, MeshData& out);
+
+// Picks the reader from the file extension (.ply, .stl, otherwise OBJ)
+bool read_mesh(const std::string& filename, MeshData& out);
+
+// Counts reported by weld()
+struct WeldStats
+{
+    size_t mergedVertices = 0;
+    size_t droppedFaces = 0;
+};
+
+// Merges vertices closer than tolerance (0 merges only identical positions),
+// remaps the triangles and drops zero-area and duplicate triangles. Runs in
+// linear time for well-spread inputs.
+WeldStats weld(MeshData& data, float tolerance);
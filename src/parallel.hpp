@@ -0,0 +1,196 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of worker threads used by the parallel loops, defaults to the
+// hardware concurrency
+inline unsigned& num_threads(){
+  static unsigned n = std::max(1u, std::thread::hardware_concurrency());
+  return n;
+}
+
+// Persistent worker threads that run one job at a time. A job is a number
+// of tasks that the workers and the calling thread claim from a shared
+// counter, so a job may run on any number of threads. Workers are started
+// on first use and sleep between jobs.
+class ThreadPool
+{
+  public:
+    static ThreadPool& instance(){
+      static ThreadPool pool;
+      return pool;
+    }
+
+    ~ThreadPool(){
+      {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stop = true;
+      }
+      this->wake.notify_all();
+      for (std::thread& w : this->workers) {
+        w.join();
+      }
+    }
+
+    // Calls task(context, t) for every t in [0, tasks) on up to `threads`
+    // threads and returns once all are done. Returns false without running
+    // anything if the pool is busy or called from one of its own tasks.
+    bool run(size_t tasks, unsigned threads, void (*task)(void*, size_t), void* context){
+      if (in_task() || !this->submit.try_lock()) {
+        return false;
+      }
+      std::lock_guard<std::mutex> submitted(this->submit, std::adopt_lock);
+      std::unique_lock<std::mutex> lock(this->mutex);
+      // a worker that woke late for the previous job may still be leaving it
+      this->done.wait(lock, [this](){ return this->active == 0; });
+      while (this->workers.size() + 1 < threads) {
+        this->workers.emplace_back([this](){ work(); });
+      }
+      this->task = task;
+      this->context = context;
+      this->tasks = tasks;
+      this->next.store(0);
+      this->pending = tasks;
+      this->generation++;
+      lock.unlock();
+      this->wake.notify_all();
+      size_t finished = run_tasks();
+      lock.lock();
+      this->pending -= finished;
+      this->done.wait(lock, [this](){ return this->pending == 0; });
+      return true;
+    }
+
+  private:
+    std::vector<std::thread> workers;
+    std::mutex submit;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool stop = false;
+    size_t generation = 0;
+    size_t active = 0;
+    void (*task)(void*, size_t) = nullptr;
+    void* context = nullptr;
+    size_t tasks = 0;
+    std::atomic<size_t> next{0};
+    size_t pending = 0;
+
+    static bool& in_task(){
+      static thread_local bool flag = false;
+      return flag;
+    }
+
+    // Claims and runs tasks of the current job until none are left
+    size_t run_tasks(){
+      in_task() = true;
+      size_t finished = 0;
+      for (size_t t = this->next++; t < this->tasks; t = this->next++) {
+        this->task(this->context, t);
+        finished++;
+      }
+      in_task() = false;
+      return finished;
+    }
+
+    void work(){
+      size_t seen = 0;
+      std::unique_lock<std::mutex> lock(this->mutex);
+      while (true) {
+        this->wake.wait(lock, [&](){ return this->stop || this->generation != seen; });
+        if (this->stop) {
+          return;
+        }
+        seen = this->generation;
+        this->active++;
+        lock.unlock();
+        size_t finished = run_tasks();
+        lock.lock();
+        this->active--;
+        this->pending -= finished;
+        if (this->pending == 0 || this->active == 0) {
+          this->done.notify_all();
+        }
+      }
+    }
+};
+
+// Calls f(i) for every i in [0, n). The range is cut into one contiguous
+// block per thread, so f must only write state owned by index i. Blocks run
+// on the persistent pool; nested calls run serially on the calling thread.
+template <class F>
+void parallel_for(size_t n, F f){
+  size_t threads = std::min<size_t>(num_threads(), n);
+  struct Job
+  {
+      F& f;
+      size_t n;
+      size_t threads;
+      static void run(void* context, size_t t){
+        Job& job = *static_cast<Job*>(context);
+        for (size_t i = job.n * t / job.threads; i < job.n * (t + 1) / job.threads; i++) {
+          job.f(i);
+        }
+      }
+  };
+  Job job{f, n, threads};
+  if (threads <= 1 || !ThreadPool::instance().run(threads, threads, &Job::run, &job)) {
+    for (size_t i = 0; i < n; i++) {
+      f(i);
+    }
+  }
+}
+
+// Parallel LSD radix sort of items on the low `bits` bits of key(item), 11
+// bits per pass. Every thread histograms and scatters its own block; the
+// prefix sum runs in (digit, block) order so the sort is stable.
+template <class T, class Key>
+void radix_sort(std::vector<T>& items, std::vector<T>& scratch, int bits, Key key){
+  const int digitBits = 11;
+  const size_t buckets = 1 << digitBits;
+  size_t n = items.size();
+  if (n == 0) {
+    return;
+  }
+  size_t blocks = std::max<size_t>(1, std::min<size_t>(num_threads(), n / 65536));
+  std::vector<size_t> count(blocks * buckets);
+  scratch.resize(n);
+  for (int shift = 0; shift < bits; shift += digitBits) {
+    parallel_for(blocks, [&](size_t b){
+      size_t* c = &count[b * buckets];
+      std::fill(c, c + buckets, 0);
+      for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; i++) {
+        c[(key(items[i]) >> shift) & (buckets - 1)]++;
+      }
+    });
+    // skip passes where every key shares the same digit
+    size_t first = (key(items[0]) >> shift) & (buckets - 1);
+    size_t same = 0;
+    for (size_t b = 0; b < blocks; b++) {
+      same += count[b * buckets + first];
+    }
+    if (same == n) {
+      continue;
+    }
+    size_t sum = 0;
+    for (size_t d = 0; d < buckets; d++) {
+      for (size_t b = 0; b < blocks; b++) {
+        size_t t = count[b * buckets + d];
+        count[b * buckets + d] = sum;
+        sum += t;
+      }
+    }
+    parallel_for(blocks, [&](size_t b){
+      size_t* c = &count[b * buckets];
+      for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; i++) {
+        scratch[c[(key(items[i]) >> shift) & (buckets - 1)]++] = items[i];
+      }
+    });
+    items.swap(scratch);
+  }
+}
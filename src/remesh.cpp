@@ -0,0 +1,268 @@
+#include "mesh.hpp"
+#include "parallel.hpp"
+#include "worklist.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <glm/geometric.hpp>
+#include <iostream>
+#include <vector>
+
+// Isotropic remeshing (Botsch and Kobbelt, "A remeshing approach to
+// multiresolution modeling"). Splitting edges above 4/3 of the target and
+// collapsing those below 4/5 leaves edges within a factor of 5/3 of each
+// other; flips then even out the valences and tangential relaxation evens
+// out the vertex spacing without leaving the surface.
+
+namespace {
+
+const float splitRatio = 4.0f / 3.0f;
+const float collapseRatio = 4.0f / 5.0f;
+
+}
+
+// Every phase sweeps the mesh once for candidate edges and then works from
+// its worklist: the operations of a round run in parallel, and only the
+// edges around the vertices they changed are checked again. Splits get
+// their new vertex and face slots from a prefix over the round, collapses
+// release theirs after it, so the parallel part writes nothing shared.
+template <class Index>
+bool BasicMesh<Index>::remesh(float targetLength, int iterations){
+  if (!this->freeVertices.empty() || !this->freeFaces.empty()) {
+    compact();
+  }
+  if (num_faces() == 0) {
+    return true;
+  }
+  invalidate_adjacency();
+  float high2 = splitRatio * targetLength * splitRatio * targetLength;
+  float low2 = collapseRatio * targetLength * collapseRatio * targetLength;
+  auto length2 = [&](Index he){
+    glm::vec3 d = this->positions[edge_head(edge_next(he))] - this->positions[edge_head(he)];
+    return glm::dot(d, d);
+  };
+  auto boundary = [&](Index v){
+    return edge_pair(edge_prev(vertex_halfEdge(v))) == 0;
+  };
+  auto midpoint = [&](Index he){
+    return (this->positions[edge_head(he)] + this->positions[edge_head(edge_next(he))]) * 0.5f;
+  };
+  std::vector<Index> touched;
+  std::vector<Index> removed;
+
+  for (int iteration = 0; iteration < iterations; iteration++) {
+    // the operations below run in parallel and must not queue faces for
+    // update_normals; the relaxation recomputes the normals at the end
+    this->normalsValid = false;
+    // split long edges at their midpoints
+    {
+      Worklist<Index> work(*this);
+      auto longEdge = [&](Index he){
+        return length2(he) > high2;
+      };
+      auto always = [](Index){
+        return true;
+      };
+      work.sweep(longEdge);
+      while (work.select(longEdge, always)) {
+        const std::vector<Index>& picked = work.picked;
+        size_t numVertices = this->positions.size();
+        size_t numFaces = num_faces();
+        std::vector<Index> firstFace(picked.size());
+        size_t newFaces = 0;
+        for (size_t i = 0; i < picked.size(); i++) {
+          firstFace[i] = numFaces + 1 + newFaces;
+          newFaces += edge_pair(picked[i]) ? 2 : 1;
+        }
+        if (!fits(numVertices - 1 + picked.size(), numFaces + newFaces)) {
+          std::cerr << "Mesh: remeshing does not fit " << 8 * sizeof(Index) << "-bit indices" << std::endl;
+          recompute_normals();
+          return false;
+        }
+        this->positions.resize(numVertices + picked.size());
+        this->normals.resize(numVertices + picked.size());
+        this->vertexHalfEdges.resize(numVertices + picked.size());
+        this->halfEdges.resize(3 * (numFaces + newFaces) + 1);
+        touched.assign(picked.size(), 0);
+        parallel_for(picked.size(), [&](size_t i){
+          Index he = picked[i];
+          Index v = numVertices + i;
+          glm::vec3 p = midpoint(he);
+          split_edge(he, v, firstFace[i], edge_pair(he) ? firstFace[i] + 1 : 0);
+          this->positions[v] = p;
+          touched[i] = v;
+        });
+        work.gather(touched, longEdge);
+      }
+    }
+
+    // collapse short interior edges into their midpoints, unless that makes
+    // an edge long again or turns a face over
+    {
+      Worklist<Index> work(*this);
+      auto shortEdge = [&](Index he){
+        return length2(he) < low2 && !boundary(edge_head(he)) && !boundary(edge_head(edge_next(he)));
+      };
+      // both ends are interior, so their outgoing half-edges reach every
+      // neighbour and every face; the two faces of the edge go away
+      auto collapsible = [&](Index he){
+        if (!edge_collapsible(he)) {
+          return false;
+        }
+        glm::vec3 p = midpoint(he);
+        Index f0 = edge_left(he);
+        Index f1 = edge_left(edge_pair(he));
+        for (Index end : {edge_head(he), edge_head(edge_next(he))}) {
+          const glm::vec3& q = this->positions[end];
+          for (Index out : vertex_outgoing(end)) {
+            const glm::vec3& a = this->positions[edge_head(edge_next(out))];
+            glm::vec3 d = a - p;
+            if (glm::dot(d, d) > high2) {
+              return false;
+            }
+            Index f = edge_left(out);
+            if (f == f0 || f == f1) {
+              continue;
+            }
+            const glm::vec3& b = this->positions[edge_head(edge_prev(out))];
+            if (glm::dot(glm::cross(a - q, b - q), glm::cross(a - p, b - p)) <= 0.0f) {
+              return false;
+            }
+          }
+        }
+        return true;
+      };
+      work.sweep(shortEdge);
+      while (work.select(shortEdge, collapsible)) {
+        const std::vector<Index>& picked = work.picked;
+        touched.assign(picked.size(), 0);
+        removed.assign(3 * picked.size(), 0);
+        parallel_for(picked.size(), [&](size_t i){
+          Index he = picked[i];
+          glm::vec3 p = midpoint(he);
+          removed[3 * i] = edge_head(he);
+          removed[3 * i + 1] = edge_left(he);
+          removed[3 * i + 2] = edge_left(edge_pair(he));
+          Index v = collapse_edge(he);
+          this->positions[v] = p;
+          touched[i] = v;
+        });
+        for (size_t i = 0; i < picked.size(); i++) {
+          this->freeVertices.push_back(removed[3 * i]);
+          this->freeFaces.push_back(removed[3 * i + 1]);
+          this->freeFaces.push_back(removed[3 * i + 2]);
+        }
+        work.gather(touched, shortEdge);
+      }
+      compact();
+    }
+
+    // flip edges whose flip brings the valences of its four vertices
+    // closer to 6, or 4 on the boundary
+    {
+      std::vector<int> valence(this->positions.size(), 0);
+      parallel_for(this->positions.size() - 1, [&](size_t i){
+        for (Index u : vertex_neighbours(i + 1)) {
+          (void)u;
+          valence[i + 1]++;
+        }
+      });
+      auto deviation = [&](Index v, int change){
+        int d = valence[v] + change - (boundary(v) ? 4 : 6);
+        return d * d;
+      };
+      auto improves = [&](Index he){
+        Index pair = edge_pair(he);
+        if (pair == 0) {
+          return false;
+        }
+        Index v0 = edge_head(he);
+        Index v1 = edge_head(edge_next(he));
+        Index v2 = edge_head(edge_prev(he));
+        Index v3 = edge_head(edge_prev(pair));
+        if (valence[v0] <= 3 || valence[v1] <= 3) {
+          return false;
+        }
+        int before = deviation(v0, 0) + deviation(v1, 0) + deviation(v2, 0) + deviation(v3, 0);
+        int after = deviation(v0, -1) + deviation(v1, -1) + deviation(v2, 1) + deviation(v3, 1);
+        return after < before;
+      };
+      // the new edge must not exist yet, and the new faces must face the
+      // same way as the old ones
+      auto flippable = [&](Index he){
+        Index v0 = edge_head(he);
+        Index v1 = edge_head(edge_next(he));
+        Index v2 = edge_head(edge_prev(he));
+        Index v3 = edge_head(edge_prev(edge_pair(he)));
+        if (v2 == v3) {
+          return false;
+        }
+        for (Index u : vertex_neighbours(v2)) {
+          if (u == v3) {
+            return false;
+          }
+        }
+        const glm::vec3& p0 = this->positions[v0];
+        const glm::vec3& p1 = this->positions[v1];
+        const glm::vec3& p2 = this->positions[v2];
+        const glm::vec3& p3 = this->positions[v3];
+        glm::vec3 n = glm::cross(p1 - p0, p2 - p0) + glm::cross(p0 - p1, p3 - p1);
+        return glm::dot(glm::cross(p2 - p3, p0 - p3), n) > 0.0f && glm::dot(glm::cross(p2 - p1, p3 - p1), n) > 0.0f;
+      };
+      Worklist<Index> work(*this);
+      work.sweep(improves);
+      while (work.select(improves, flippable)) {
+        const std::vector<Index>& picked = work.picked;
+        touched.assign(4 * picked.size(), 0);
+        parallel_for(picked.size(), [&](size_t i){
+          Index he = picked[i];
+          Index v0 = edge_head(he);
+          Index v1 = edge_head(edge_next(he));
+          Index v2 = edge_head(edge_prev(he));
+          Index v3 = edge_head(edge_prev(edge_pair(he)));
+          flip_edge(he);
+          valence[v0]--;
+          valence[v1]--;
+          valence[v2]++;
+          valence[v3]++;
+          touched[4 * i] = v0;
+          touched[4 * i + 1] = v1;
+          touched[4 * i + 2] = v2;
+          touched[4 * i + 3] = v3;
+        });
+        work.gather(touched, improves);
+      }
+    }
+
+    // tangential relaxation: interior vertices move to the centroid of their
+    // neighbours, minus the part along their normal
+    recompute_normals();
+    Buffer<glm::vec3> relaxed(this->positions.size());
+    parallel_for(this->positions.size() - 1, [&](size_t i){
+      Index v = i + 1;
+      glm::vec3 p = this->positions[v];
+      relaxed[v] = p;
+      if (vertex_halfEdge(v) == 0 || boundary(v)) {
+        return;
+      }
+      glm::vec3 centroid(0.0f);
+      int count = 0;
+      for (Index u : vertex_neighbours(v)) {
+        centroid += this->positions[u];
+        count++;
+      }
+      glm::vec3 d = centroid / (float)count - p;
+      const glm::vec3& n = this->normals[v];
+      relaxed[v] = p + d - n * glm::dot(n, d);
+    });
+    this->positions = std::move(relaxed);
+  }
+  recompute_normals();
+  return true;
+}
+
+#define INSTANTIATE_REMESH(Index) \
+  template bool BasicMesh<Index>::remesh(float, int);
+
+INSTANTIATE_REMESH(uint16_t)
+INSTANTIATE_REMESH(uint32_t)
+INSTANTIATE_REMESH(uint64_t)
@@ -0,0 +1,540 @@
+#pragma once
+#include "mesh.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Scheduling of local edge operations (edge_split, edge_flip,
+// edge_collapse) in conflict-free parallel rounds, shared by remesh and
+// apply_edge_operations.
+
+// An edge by its ends, which unlike half-edge indices survive the
+// operations around it, the half-edge it was last seen at, and the item of
+// the caller's it stands for
+template <class Index>
+struct EdgeOp
+{
+    Index from;
+    Index to;
+    Index halfEdge;
+    size_t item;
+};
+
+// Half-edge from one vertex to another, 0 if the edge is gone
+template <class Index>
+Index find_edge(BasicMesh<Index>& mesh, const EdgeOp<Index>& edge){
+  Index he = edge.halfEdge;
+  Index from = edge.from;
+  Index to = edge.to;
+  if (mesh.edge_head(he) == from && mesh.edge_head(mesh.edge_next(he)) == to) {
+    return he;
+  }
+  if (mesh.vertex_deleted(from)) {
+    return 0;
+  }
+  for (Index out : mesh.vertex_outgoing(from)) {
+    if (mesh.edge_head(mesh.edge_next(out)) == to) {
+      return out;
+    }
+  }
+  return 0;
+}
+
+// Calls f for the outgoing half-edges of v and, on the boundary, the
+// incoming boundary half-edge, so every edge at v once
+template <class Index, class F>
+void for_vertex_edges(BasicMesh<Index>& mesh, Index v, F f){
+  Index start = mesh.vertex_halfEdge(v);
+  if (start == 0) {
+    return;
+  }
+  for (Index he : mesh.vertex_outgoing(v)) {
+    f(he);
+  }
+  Index incoming = mesh.edge_prev(start);
+  if (mesh.edge_pair(incoming) == 0) {
+    f(incoming);
+  }
+}
+
+// Keeps the entries of list for which keep(entry) holds, in order
+template <class T, class Keep>
+void keep_if(std::vector<T>& list, Keep keep){
+  size_t n = list.size();
+  size_t blocks = std::max<size_t>(1, std::min<size_t>(num_threads(), n / 4096));
+  std::vector<size_t> start(blocks + 1, 0);
+  std::vector<char> kept(n);
+  parallel_for(blocks, [&](size_t b){
+    for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; i++) {
+      kept[i] = keep(list[i]);
+      start[b + 1] += kept[i];
+    }
+  });
+  for (size_t b = 0; b < blocks; b++) {
+    start[b + 1] += start[b];
+  }
+  std::vector<T> out(start[blocks]);
+  parallel_for(blocks, [&](size_t b){
+    size_t k = start[b];
+    for (size_t i = n * b / blocks; i < n * (b + 1) / blocks; i++) {
+      if (kept[i]) {
+        out[k++] = list[i];
+      }
+    }
+  });
+  list.swap(out);
+}
+
+// Edges waiting for an operation, applied in rounds. An operation on an
+// edge reads and writes only faces with a corner among the edge's ends and
+// its opposite corners, so two operations are independent when no such
+// vertex of one is, or neighbours, such a vertex of the other. The queue is
+// coloured into up to 64 independent sets, and each round applies one of
+// them in parallel without locks. As earlier rounds change the mesh, a
+// colour is checked again against the current one-rings when its round
+// comes; edges that no longer fit go back to the queue, behind the edges
+// around the vertices the rounds changed, for the next colouring.
+//
+// Both run in parallel steps of deterministic reservations (Jones and
+// Plassmann): every edge still undecided stakes a priority, a hash of its
+// place in the queue, on its corners, and the edges whose reach (corners
+// and their neighbours) holds no higher stake win. In the colouring the
+// winners take the first colour not yet taken in their reach; in the checks
+// they make the round, and edges with a corner in a winner's reach are put
+// off. The others stake again until none is left. The outcome is that of a
+// serial greedy pass in priority order, which single threads and small sets
+// take instead, so it does not depend on the number of threads.
+template <class Index>
+class Worklist
+{
+  public:
+    // half-edges picked by the last select, and their items
+    std::vector<Index> picked;
+    std::vector<size_t> items;
+
+    explicit Worklist(BasicMesh<Index>& mesh) : mesh(mesh), colours(64){}
+
+    // Queues every edge for which wanted(he) holds, in half-edge order
+    template <class Wanted>
+    void sweep(Wanted wanted){
+      size_t numHalfEdges = 3 * (size_t)this->mesh.num_faces();
+      const size_t block = 4096;
+      std::vector<std::vector<EdgeOp<Index>>> found((numHalfEdges + block - 1) / block);
+      parallel_for(found.size(), [&](size_t b){
+        size_t last = std::min(numHalfEdges, (b + 1) * block);
+        for (size_t i = b * block; i < last; i++) {
+          Index he = i + 1;
+          Index pair = this->mesh.edge_pair(he);
+          if (this->mesh.edge_head(he) != 0 && (pair == 0 || he > pair) && wanted(he)) {
+            found[b].push_back(op(he));
+          }
+        }
+      });
+      append(found);
+    }
+
+    // Queues the edge at he for the given item
+    void push(Index he, size_t item){
+      this->work.push_back(op(he, item));
+    }
+
+    // Picks the edges of the next round, false once the queue is drained.
+    // Edges that are gone, no longer wanted or not valid are dropped.
+    template <class Wanted, class Valid>
+    bool select(Wanted wanted, Valid valid){
+      this->picked.clear();
+      this->items.clear();
+      while (this->picked.empty()) {
+        if (this->colour == this->colours.size()) {
+          if (!colour_queue(wanted)) {
+            return false;
+          }
+        }
+        std::vector<EdgeOp<Index>>& edges = this->colours[this->colour++];
+        size_t n = edges.size();
+        std::vector<Index> found(n);
+        std::vector<char> ok(n);
+        parallel_for(n, [&](size_t i){
+          Index he = find_edge(this->mesh, edges[i]);
+          found[i] = he;
+          ok[i] = he != 0 && wanted(he) && valid(he);
+        });
+        std::vector<size_t> candidates(n);
+        for (size_t i = 0; i < n; i++) {
+          candidates[i] = i;
+        }
+        keep_if(candidates, [&](size_t i){
+          return ok[i] != 0;
+        });
+        std::vector<char> won(n, 0);
+        uint64_t since = independent_set(found, candidates, won);
+        // edges that lost to a winner wait for the next colouring, as do the
+        // invalid ones next to a winner, whose rings the round changes
+        for (size_t i = 0; i < n; i++) {
+          if (won[i]) {
+            this->picked.push_back(found[i]);
+            this->items.push_back(edges[i].item);
+          } else if (found[i] != 0 && (ok[i] || reached(found[i], since))) {
+            this->work.push_back(op(found[i], edges[i].item));
+          }
+        }
+        edges.clear();
+      }
+      return true;
+    }
+
+    // Queues the edges at the given vertices for which wanted(he) holds.
+    // Zeros and deleted vertices are skipped.
+    template <class Wanted>
+    void gather(const std::vector<Index>& touched, Wanted wanted){
+      prepare();
+      uint64_t tag = next_tag();
+      std::vector<Index> vertices;
+      for (Index v : touched) {
+        if (v != 0 && !this->mesh.vertex_deleted(v) && this->marks[v].load(std::memory_order_relaxed) != tag) {
+          this->marks[v].store(tag, std::memory_order_relaxed);
+          vertices.push_back(v);
+        }
+      }
+      const size_t block = 256;
+      std::vector<std::vector<EdgeOp<Index>>> found((vertices.size() + block - 1) / block);
+      parallel_for(found.size(), [&](size_t b){
+        size_t last = std::min(vertices.size(), (b + 1) * block);
+        for (size_t i = b * block; i < last; i++) {
+          Index v = vertices[i];
+          for_vertex_edges(this->mesh, v, [&](Index he){
+            Index u = this->mesh.edge_head(he);
+            if (u == v) {
+              u = this->mesh.edge_head(this->mesh.edge_next(he));
+            }
+            // an edge between two touched vertices is queued from the lower one
+            if (this->marks[u].load(std::memory_order_relaxed) == tag && u < v) {
+              return;
+            }
+            if (wanted(he)) {
+              found[b].push_back(op(he));
+            }
+          });
+        }
+      });
+      append(found);
+    }
+
+  private:
+    BasicMesh<Index>& mesh;
+    std::vector<EdgeOp<Index>> work;
+    std::vector<std::vector<EdgeOp<Index>>> colours;
+    size_t colour = 64;
+    // Reservation state per vertex: the highest priority staked on it, and
+    // the step in which a winner's reach last covered it. Both hold a step
+    // counter in the top 24 bits, so values from earlier steps never need
+    // clearing. used holds the colours of the edges each vertex is a corner of
+    // during a colouring, and is clear between colourings.
+    std::vector<std::atomic<uint64_t>> reserved;
+    std::vector<std::atomic<uint64_t>> marks;
+    std::vector<std::atomic<uint64_t>> used;
+    uint64_t step = 0;
+    static const int priorityBits = 40;
+
+    EdgeOp<Index> op(Index he, size_t item = 0){
+      EdgeOp<Index> edge;
+      edge.from = this->mesh.edge_head(he);
+      edge.to = this->mesh.edge_head(this->mesh.edge_next(he));
+      edge.halfEdge = he;
+      edge.item = item;
+      return edge;
+    }
+
+    void append(const std::vector<std::vector<EdgeOp<Index>>>& found){
+      for (const std::vector<EdgeOp<Index>>& ops : found) {
+        this->work.insert(this->work.end(), ops.begin(), ops.end());
+      }
+    }
+
+    // Calls f for the ends and the opposite corners of he
+    template <class F>
+    void for_corners(Index he, F f){
+      f(this->mesh.edge_head(he));
+      f(this->mesh.edge_head(this->mesh.edge_next(he)));
+      f(this->mesh.edge_head(this->mesh.edge_prev(he)));
+      Index pair = this->mesh.edge_pair(he);
+      if (pair != 0) {
+        f(this->mesh.edge_head(this->mesh.edge_prev(pair)));
+      }
+    }
+
+    // Calls f for the corners of he and their neighbours, some more than once
+    template <class F>
+    void for_reach(Index he, F f){
+      for_corners(he, [&](Index v){
+        f(v);
+        for (Index u : this->mesh.vertex_neighbours(v)) {
+          f(u);
+        }
+      });
+    }
+
+    // Whether a corner of he lies in the reach of a winner marked since the tag
+    bool reached(Index he, uint64_t since){
+      bool hit = false;
+      for_corners(he, [&](Index v){
+        hit |= this->marks[v].load(std::memory_order_relaxed) >= since;
+      });
+      return hit;
+    }
+
+    void mark_reach(Index he, uint64_t tag){
+      for_reach(he, [&](Index v){
+        this->marks[v].store(tag, std::memory_order_relaxed);
+      });
+    }
+
+    void stake(Index v, uint64_t value){
+      std::atomic<uint64_t>& slot = this->reserved[v];
+      uint64_t current = slot.load(std::memory_order_relaxed);
+      while (current < value && !slot.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+      }
+    }
+
+    // Grows the reservation state to cover the current vertices. It grows
+    // by doubling, as splits add vertices every round; the step tags make
+    // the old values safe to drop.
+    void prepare(){
+      size_t n = this->mesh.vertex_positions().size();
+      if (this->reserved.size() < n) {
+        n = std::max(n, 2 * this->reserved.size());
+        std::vector<std::atomic<uint64_t>>(n).swap(this->reserved);
+        std::vector<std::atomic<uint64_t>>(n).swap(this->marks);
+        std::vector<std::atomic<uint64_t>>(n).swap(this->used);
+        parallel_for(n, [&](size_t v){
+          this->reserved[v].store(0, std::memory_order_relaxed);
+          this->marks[v].store(0, std::memory_order_relaxed);
+          this->used[v].store(0, std::memory_order_relaxed);
+        });
+      }
+    }
+
+    uint64_t next_tag(){
+      if (++this->step == (uint64_t)1 << (64 - priorityBits)) {
+        parallel_for(this->reserved.size(), [&](size_t v){
+          this->reserved[v].store(0, std::memory_order_relaxed);
+          this->marks[v].store(0, std::memory_order_relaxed);
+        });
+        this->step = 1;
+      }
+      return this->step << priorityBits;
+    }
+
+    // Priorities below 2^priorityBits, distinct for distinct places. Runs
+    // of 16 places keep the queue order, which keeps the serial pass close
+    // to the mesh order, and the runs are shuffled so that edges next to
+    // each other in the queue do not form long chains of falling priority.
+    static uint64_t priority(size_t i){
+      const int runBits = 4;
+      const uint64_t mask = ((uint64_t)1 << (priorityBits - runBits)) - 1;
+      uint64_t x = ((uint64_t)i >> runBits) & mask;
+      x = (x * 0x9E3779B97F4A7C15ULL) & mask;
+      x ^= x >> 18;
+      x = (x * 0xBF58476D1CE4E5B9ULL) & mask;
+      x ^= x >> 18;
+      return (x << runBits) | (~(uint64_t)i & (((uint64_t)1 << runBits) - 1));
+    }
+
+    // Whether to take the serial pass, which picks the same as the steps
+    static bool serial(size_t n){
+      return num_threads() == 1 || n < 4096;
+    }
+
+    // Sets won[i] for an independent set of the candidates, the edges at
+    // edges[i], which are used up. Returns a tag no later than the one the
+    // winners' reach is marked with.
+    uint64_t independent_set(const std::vector<Index>& edges, std::vector<size_t>& candidates, std::vector<char>& won){
+      prepare();
+      uint64_t since = next_tag();
+      if (serial(candidates.size())) {
+        std::sort(candidates.begin(), candidates.end(), [](size_t a, size_t b){
+          return priority(a) > priority(b);
+        });
+        for (size_t i : candidates) {
+          if (!reached(edges[i], since)) {
+            won[i] = 1;
+            mark_reach(edges[i], since);
+          }
+        }
+        return since;
+      }
+      while (!candidates.empty()) {
+        uint64_t tag = next_tag();
+        parallel_for(candidates.size(), [&](size_t k){
+          size_t i = candidates[k];
+          for_corners(edges[i], [&](Index v){
+            stake(v, tag | priority(i));
+          });
+        });
+        parallel_for(candidates.size(), [&](size_t k){
+          size_t i = candidates[k];
+          uint64_t value = tag | priority(i);
+          bool holds = true;
+          for_reach(edges[i], [&](Index v){
+            holds &= this->reserved[v].load(std::memory_order_relaxed) <= value;
+          });
+          won[i] = holds;
+        });
+        parallel_for(candidates.size(), [&](size_t k){
+          size_t i = candidates[k];
+          if (won[i]) {
+            mark_reach(edges[i], tag);
+          }
+        });
+        keep_if(candidates, [&](size_t i){
+          return !won[i] && !reached(edges[i], tag);
+        });
+      }
+      return since;
+    }
+
+    // Sorts the queue into the colours; edges for which all colours are
+    // taken stay queued. The parallel steps walk the reach of every edge
+    // once and keep it.
+    template <class Wanted>
+    bool colour_queue(Wanted wanted){
+      if (this->work.empty()) {
+        return false;
+      }
+      size_t n = this->work.size();
+      std::vector<Index> edges(n);
+      parallel_for(n, [&](size_t i){
+        Index he = find_edge(this->mesh, this->work[i]);
+        edges[i] = he != 0 && wanted(he) ? he : 0;
+      });
+      std::vector<size_t> active(n);
+      for (size_t i = 0; i < n; i++) {
+        active[i] = i;
+      }
+      keep_if(active, [&](size_t i){
+        return edges[i] != 0;
+      });
+      size_t m = active.size();
+      prepare();
+      const uint8_t none = (uint8_t)this->colours.size();
+      std::vector<uint8_t> colourOf(m, none);
+      auto first_free = [](uint64_t taken){
+        uint8_t c = 0;
+        while (taken & ((uint64_t)1 << c)) {
+          c++;
+        }
+        return c;
+      };
+
+      if (serial(m)) {
+        std::vector<size_t> order(m);
+        for (size_t k = 0; k < m; k++) {
+          order[k] = k;
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b){
+          return priority(active[a]) > priority(active[b]);
+        });
+        for (size_t k : order) {
+          Index he = edges[active[k]];
+          uint64_t taken = 0;
+          for_reach(he, [&](Index v){
+            taken |= this->used[v].load(std::memory_order_relaxed);
+          });
+          if (taken != ~(uint64_t)0) {
+            colourOf[k] = first_free(taken);
+            for_corners(he, [&](Index v){
+              this->used[v].fetch_or((uint64_t)1 << colourOf[k], std::memory_order_relaxed);
+            });
+          }
+        }
+      } else {
+        std::vector<Index> corners(4 * m, 0);
+        std::vector<size_t> offsets(m + 1, 0);
+        parallel_for(m, [&](size_t k){
+          int c = 0;
+          for_corners(edges[active[k]], [&](Index v){
+            corners[4 * k + c++] = v;
+          });
+          for_reach(edges[active[k]], [&](Index){
+            offsets[k + 1]++;
+          });
+        });
+        for (size_t k = 0; k < m; k++) {
+          offsets[k + 1] += offsets[k];
+        }
+        std::vector<Index> reach(offsets[m]);
+        parallel_for(m, [&](size_t k){
+          size_t j = offsets[k];
+          for_reach(edges[active[k]], [&](Index v){
+            reach[j++] = v;
+          });
+        });
+        std::vector<char> won(m, 0);
+        std::vector<size_t> pending(m);
+        for (size_t k = 0; k < m; k++) {
+          pending[k] = k;
+        }
+        while (!pending.empty()) {
+          uint64_t tag = next_tag();
+          parallel_for(pending.size(), [&](size_t p){
+            size_t k = pending[p];
+            for (int c = 0; c < 4 && corners[4 * k + c] != 0; c++) {
+              stake(corners[4 * k + c], tag | priority(active[k]));
+            }
+          });
+          parallel_for(pending.size(), [&](size_t p){
+            size_t k = pending[p];
+            uint64_t value = tag | priority(active[k]);
+            size_t j = offsets[k];
+            while (j < offsets[k + 1] && this->reserved[reach[j]].load(std::memory_order_relaxed) <= value) {
+              j++;
+            }
+            won[k] = j == offsets[k + 1];
+            if (!won[k]) {
+              return;
+            }
+            uint64_t taken = 0;
+            for (j = offsets[k]; j < offsets[k + 1]; j++) {
+              taken |= this->used[reach[j]].load(std::memory_order_relaxed);
+            }
+            if (taken != ~(uint64_t)0) {
+              colourOf[k] = first_free(taken);
+            }
+          });
+          parallel_for(pending.size(), [&](size_t p){
+            size_t k = pending[p];
+            for (int c = 0; c < 4 && colourOf[k] != none && corners[4 * k + c] != 0; c++) {
+              this->used[corners[4 * k + c]].fetch_or((uint64_t)1 << colourOf[k], std::memory_order_relaxed);
+            }
+          });
+          keep_if(pending, [&](size_t k){
+            return !won[k];
+          });
+        }
+      }
+
+      // only corners of the queue were coloured, so clearing them leaves
+      // used clear for the next colouring
+      parallel_for(m, [&](size_t k){
+        for_corners(edges[active[k]], [&](Index v){
+          this->used[v].store(0, std::memory_order_relaxed);
+        });
+      });
+      std::vector<EdgeOp<Index>> rest;
+      for (size_t k = 0; k < m; k++) {
+        size_t i = active[k];
+        EdgeOp<Index> edge = op(edges[i], this->work[i].item);
+        if (colourOf[k] != none) {
+          this->colours[colourOf[k]].push_back(edge);
+        } else {
+          rest.push_back(edge);
+        }
+      }
+      this->work.swap(rest);
+      this->colour = 0;
+      return true;
+    }
+};